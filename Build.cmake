@@ -54,5 +54,11 @@ if (BUILD_INCLUDE_WHAT_YOU_USE)
   endif(BUILD_IWYU_PROGRAM)
 endif (BUILD_INCLUDE_WHAT_YOU_USE)
 
+# Optional: Detect allocations and locks in real-time code paths.
+option(BUILD_REALTIME_CHECK
+  "Report memory allocation and mutex locks in real-time scopes."
+  OFF
+)
+
 # Combined compiler flags for convenience.
 set(BUILD_COMPILER_FLAGS "${BUILD_WARNING_FLAGS} ${BUILD_SANITIZE_FLAGS}")
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "sosso/RealtimeCheck.hpp"
+#include <cstdlib>
+#include <dlfcn.h>
+#include <new>
+#include <pthread.h>
+
+// Interpose allocation and locking functions to detect real-time violations,
+// see sosso::RealtimeCheck. Linked into the application only when built with
+// BUILD_REALTIME_CHECK.
+
+#if defined(__GLIBC__)
+// Use the glibc internal allocator, which allows to interpose malloc itself.
+extern "C" void *__libc_malloc(std::size_t size);
+extern "C" void *__libc_calloc(std::size_t count, std::size_t size);
+extern "C" void *__libc_realloc(void *pointer, std::size_t size);
+extern "C" void __libc_free(void *pointer);
+
+extern "C" void *malloc(std::size_t size) {
+  sosso::RealtimeCheck::check("malloc");
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(std::size_t count, std::size_t size) {
+  sosso::RealtimeCheck::check("calloc");
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, std::size_t size) {
+  sosso::RealtimeCheck::check("realloc");
+  return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void *pointer) {
+  if (pointer) {
+    sosso::RealtimeCheck::check("free");
+  }
+  __libc_free(pointer);
+}
+
+static void *allocate(std::size_t size) { return __libc_malloc(size); }
+static void deallocate(void *pointer) { __libc_free(pointer); }
+#else
+// Only C++ allocations are detected where malloc cannot be interposed safely.
+static void *allocate(std::size_t size) { return std::malloc(size); }
+static void deallocate(void *pointer) { std::free(pointer); }
+#endif
+
+void *operator new(std::size_t size) {
+  sosso::RealtimeCheck::check("operator new");
+  if (void *pointer = allocate(size > 0 ? size : 1)) {
+    return pointer;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *pointer) noexcept {
+  if (pointer) {
+    sosso::RealtimeCheck::check("operator delete");
+  }
+  deallocate(pointer);
+}
+
+void operator delete[](void *pointer) noexcept { operator delete(pointer); }
+
+void operator delete(void *pointer, std::size_t) noexcept {
+  operator delete(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept {
+  operator delete(pointer);
+}
+
+// Resolve the real mutex lock before any real-time thread runs.
+using MutexLock = int (*)(pthread_mutex_t *);
+static MutexLock real_mutex_lock =
+    reinterpret_cast<MutexLock>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+
+extern "C" int pthread_mutex_lock(pthread_mutex_t *mutex) {
+  sosso::RealtimeCheck::check("pthread_mutex_lock");
+  if (!real_mutex_lock) {
+    real_mutex_lock =
+        reinterpret_cast<MutexLock>(dlsym(RTLD_NEXT, "pthread_mutex_lock"));
+  }
+  return real_mutex_lock(mutex);
+}
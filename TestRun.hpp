@@ -17,19 +17,38 @@
 #ifndef SOSSO_TESTRUN_HPP
 #define SOSSO_TESTRUN_HPP
 
+#include "sosso/Alignment.hpp"
 #include "sosso/Buffer.hpp"
 #include "sosso/Channel.hpp"
+#include "sosso/ClipCache.hpp"
+#include "sosso/Companding.hpp"
 #include "sosso/Correction.hpp"
+#include "sosso/Distribution.hpp"
 #include "sosso/DoubleBuffer.hpp"
+#include "sosso/EventWait.hpp"
+#include "sosso/FaultInjection.hpp"
+#include "sosso/FlightRecorder.hpp"
 #include "sosso/FrameClock.hpp"
+#include "sosso/LatencyHold.hpp"
 #include "sosso/Logging.hpp"
+#include "sosso/MarginPolicy.hpp"
+#include "sosso/PeriodPool.hpp"
+#include "sosso/PriorityBoost.hpp"
+#include "sosso/ProcessGraph.hpp"
 #include "sosso/ReadChannel.hpp"
+#include "sosso/RealtimeCheck.hpp"
+#include "sosso/ReferenceClock.hpp"
+#include "sosso/SegmentedBuffer.hpp"
 #include "sosso/WriteChannel.hpp"
+#include <cmath>
+#include <type_traits>
 #include <vector>
 
 namespace sosso {
 
-class TestRun {
+// Period buffers are of type Buffer by default. With SegmentedBuffer, capture
+// pool and clip cache are not used, they hand out plain buffers.
+template <class BufferType = Buffer> class TestRun {
 public:
   ~TestRun() { close(); }
 
@@ -37,11 +56,151 @@ public:
 
   ReadChannel &in() { return _in; }
 
+  FlightRecorder &recorder() { return _recorder; }
+
+  FaultInjection &faults() { return _faults; }
+
+  void set_start_delay(std::int64_t frames) { _start_delay = frames; }
+
+  void set_xrun_probability(double per_hour) {
+    _margins.set_xrun_probability(per_hour);
+  }
+
+  void set_wakeup_compensation(double quantile) {
+    _clock.set_wakeup_compensation(quantile);
+  }
+
+  void set_follow_master(bool follow) { _follow_master = follow; }
+
+  void set_latency_hold(bool hold) { _hold_latency = hold; }
+
+  // Shift recording buffers by a calibrated offset, see Alignment.
+  void set_capture_offset(std::int64_t frames) { _capture_offset = frames; }
+
+  void set_priority_boost(std::int64_t low, std::int64_t high) {
+    _boost.set_thresholds(low, high);
+  }
+
+  void set_reference(ReferenceClock *reference) { _reference = reference; }
+
+  // Rewrite queued playback data after each processing, see rewrite().
+  void set_rewrite(bool rewrite) { _rewrite = rewrite; }
+
+  // Run a prepared processing graph for each playback period.
+  void set_graph(ProcessGraph *graph) { _graph = graph; }
+
+  // Wait for wakeup time or other events, any other event ends the run.
+  void set_event_wait(EventWait *events) { _events = events; }
+
+  // Play a cached clip of one period length, without copying.
+  void set_clip(ClipCache *cache, std::uint64_t key) {
+    _clip_cache = cache;
+    _clip_key = key;
+  }
+
+  // Capture into period buffers of the pool and publish them to its readers.
+  void set_capture_pool(PeriodPool *pool) { _capture_pool = pool; }
+
   void close() {
+    // Return unpublished capture buffers and played clips, they must not
+    // outlive the run.
+    for (unsigned i = 0; i < 2; ++i) {
+      BufferType buffer = _in.take_buffer();
+      BufferType clip = _out.take_buffer();
+      if constexpr (plain) {
+        if (_capture_pool) {
+          _capture_pool->discard(std::move(buffer));
+        }
+        if (_clip_cache) {
+          _clip_cache->release(std::move(clip));
+        }
+      }
+    }
     _out.close();
     _in.close();
   }
 
+  bool calibrate(const char *device, unsigned period, unsigned repetitions) {
+    // OSS can't switch an open channel between memory map and read / write,
+    // so run both paths separately and choose for the next run.
+    PathCost in_cost[2];
+    PathCost out_cost[2];
+    // Trial runs without injected faults and records, they would distort the
+    // cost measurement and the flight recorder history.
+    _calibrating = true;
+    for (bool memory_map : {true, false}) {
+      close();
+      _in_map = memory_map;
+      _out_map = memory_map;
+      if (!_in.open(device) || !_out.open(device) ||
+          !read_write(period, repetitions, memory_map)) {
+        close();
+        _calibrating = false;
+        _in_map = true;
+        _out_map = true;
+        return false;
+      }
+      in_cost[memory_map] = _in_cost;
+      out_cost[memory_map] = _out_cost;
+      close();
+    }
+    _calibrating = false;
+    _in_map = cheaper(in_cost[true], in_cost[false]);
+    _out_map = cheaper(out_cost[true], out_cost[false]);
+    for (bool memory_map : {true, false}) {
+      Log::info(SOSSO_LOC,
+                "%s cost per period: in %lld ns %.1f ioctls %lld lost, "
+                "out %lld ns %.1f ioctls %lld lost.",
+                memory_map ? "Memory map" : "Read / write",
+                in_cost[memory_map].cpu_per_period(),
+                in_cost[memory_map].ioctls_per_period(),
+                in_cost[memory_map].lost, out_cost[memory_map].cpu_per_period(),
+                out_cost[memory_map].ioctls_per_period(),
+                out_cost[memory_map].lost);
+    }
+    Log::info(SOSSO_LOC, "Chose %s for recording, %s for playback.",
+              _in_map ? "memory map" : "read / write",
+              _out_map ? "memory map" : "read / write");
+    return true;
+  }
+
+  bool align(const char *device, unsigned period) {
+    // Play a noise burst in the middle of silent periods, over a loopback
+    // from playback to recording, and find it in the recording. Like a second
+    // recording device, see Alignment, playback data is the reference.
+    close();
+    if (!_in.open(device) || !_out.open(device)) {
+      close();
+      return false;
+    }
+    std::vector<char> burst(period * _out.frame_size());
+    std::uint32_t seed = 1;
+    Alignment::test_signal(burst.data(), period, _out.sample_format(),
+                           _out.channels(), seed);
+    Alignment alignment;
+    alignment.init(2, align_periods * period);
+    _alignment = &alignment;
+    _burst = &burst;
+    // Measure with unshifted recording, without faults and records.
+    std::int64_t capture_offset = _capture_offset;
+    _capture_offset = 0;
+    _calibrating = true;
+    bool done = read_write(period, 2 * (align_periods + 2));
+    _calibrating = false;
+    _alignment = nullptr;
+    _burst = nullptr;
+    close();
+    // Search up to 3 periods around the burst, it spans period 3 of 8.
+    if (!done || !alignment.estimate(3 * period)) {
+      _capture_offset = capture_offset;
+      return false;
+    }
+    _capture_offset = alignment.offset(1);
+    Log::info(SOSSO_LOC, "Recording offset by %lld frames against playback.",
+              _capture_offset);
+    return true;
+  }
+
   bool read_write(unsigned period, unsigned repetitions,
                   bool memory_map = true) {
     if (!_in.recording()) {
@@ -52,31 +211,37 @@ public:
       Log::warn(SOSSO_LOC, "Out device not in playback mode.");
       return false;
     }
-    if (memory_map && _in.can_memory_map() && !_in.memory_map()) {
+    if (memory_map && _in_map && _in.can_memory_map() && !_in.memory_map()) {
       Log::warn(SOSSO_LOC, "In device not memory mapped.");
       return false;
     }
-    if (memory_map && _out.can_memory_map() && !_out.memory_map()) {
+    if (memory_map && _out_map && _out.can_memory_map() &&
+        !_out.memory_map()) {
       Log::warn(SOSSO_LOC, "Out device not memory mapped.");
       return false;
     }
+    if (_out.write_ahead() < _out.buffer_frames()) {
+      Log::info(SOSSO_LOC, "Write ahead limited to %lld of %u frames.",
+                _out.write_ahead(), _out.buffer_frames());
+    }
     // Compute period time, sync time and frame progress.
     Log::info(SOSSO_LOC, "Period of %u is %lld ns.", period,
               _clock.frames_to_time(period));
     // Create buffer data and prepare channels.
-    std::vector<char> in_buffer_data(period * _in.frame_size(), '\0');
-    Buffer in_buffer(in_buffer_data.data(), in_buffer_data.size());
-    std::int64_t in_frames = period;
+    std::vector<char> in_buffer_data(period * _in.frame_size(), _in.silence());
+    BufferType in_buffer = capture_buffer(in_buffer_data);
+    std::int64_t in_frames = period + _capture_offset;
     _in.set_buffer(std::move(in_buffer), in_frames);
-    in_buffer = Buffer(in_buffer_data.data(), in_buffer_data.size());
+    in_buffer = capture_buffer(in_buffer_data);
     in_frames += period;
     _in.set_buffer(std::move(in_buffer), in_frames);
-    std::vector<char> out_buffer_data(period * _out.frame_size(), '\0');
-    Buffer out_buffer(out_buffer_data.data(), out_buffer_data.size());
+    std::vector<char> out_buffer_data(period * _out.frame_size(),
+                                      _out.silence());
+    BufferType out_buffer = playback_buffer(out_buffer_data, 0);
     std::int64_t out_frames = period;
     _out.set_buffer(std::move(out_buffer), out_frames);
     out_frames += period;
-    out_buffer = Buffer(out_buffer_data.data(), out_buffer_data.size());
+    out_buffer = playback_buffer(out_buffer_data, 1);
     _out.set_buffer(std::move(out_buffer), out_frames);
     // Step is 16 frames at 48kHz and lower, 32 at 96kHz, 64 at 192kHz.
     if (_out.stepping() != _out.stepping() ||
@@ -90,27 +255,89 @@ public:
     // Initialize correction parameters.
     _in_correction.set_drift_limit(64);
     _out_correction.set_drift_limit(64);
+    // Record recent scheduling history, about 5s. Each wakeup records up to
+    // 3 events, itself and the progress of both channels, about one wakeup
+    // per step. Each period adds buffer and correction events of both.
+    // Allocate only once, the ring may be dumped concurrently.
+    if (!_recorder.enabled()) {
+      unsigned rate = _in.sample_rate();
+      _recorder.init(5 * (3 * rate / _in.stepping() + 4 * rate / period),
+                     rate);
+    }
+    FlightRecorder *recorder = _calibrating ? nullptr : &_recorder;
+    _in.set_recorder(recorder, in_source);
+    _out.set_recorder(recorder, out_source);
+    // Inject faults as configured, to measure recovery.
+    FaultInjection *faults = _calibrating ? nullptr : &_faults;
+    _in.set_fault_injection(faults);
+    _out.set_fault_injection(faults);
+    _clock.set_fault_injection(faults);
     // Add channels to group for synchronous start.
     int sync_group_id = 0;
     if (!_in.add_to_sync_group(sync_group_id) ||
         !_out.add_to_sync_group(sync_group_id)) {
       return false;
     }
-    if (!_in.start_sync_group(sync_group_id)) {
-      return false;
+    if (_start_delay > 0) {
+      // Start at a scheduled time, with prefilled playback buffer.
+      if (!scheduled_start(sync_group_id)) {
+        return false;
+      }
+    } else {
+      if (!_in.start_sync_group(sync_group_id)) {
+        return false;
+      }
+      // Get current time.
+      if (!_clock.init_clock(_in.sample_rate())) {
+        return false;
+      }
     }
-    // Get current time.
-    if (!_clock.init_clock(_in.sample_rate())) {
-      return false;
+    if (_reference) {
+      // Measure reference balance relative to start.
+      _reference->reset_origin();
     }
+    // Released on every return, when going out of scope.
+    LatencyHold latency_hold;
+    if (_hold_latency) {
+      // Keep CPU wakeup latency well below the shortest processing step of
+      // both channels, or the period if that is even shorter.
+      unsigned step = std::min({period, _in.stepping(), _out.stepping()});
+      std::int64_t step_us = _clock.frames_to_time(step) / 1000;
+      latency_hold.hold(std::max<std::int64_t>(step_us / 4, 1));
+    }
+    // Expand companded recordings to linear samples, as a client would.
+    bool companded = Companding::companded(_in.sample_format());
+    std::vector<float> linear(companded ? period * _in.channels() : 0);
+    float peak = 0;
+    // Measure processing cost of the chosen paths.
+    _in_cost = PathCost();
+    _out_cost = PathCost();
+    std::int64_t rewritten = 0;
+    std::uint64_t in_ioctls = _in.ioctl_count();
+    std::uint64_t out_ioctls = _out.ioctl_count();
+    // Drop a priority boost on every return from the processing loop.
+    PriorityBoostScope boost_scope(_boost);
     // Repeated read and wait.
     unsigned finished = 0;
-    while (repetitions > finished) {
+    _interrupted = false;
+    while (repetitions > finished && !_interrupted) {
       if (!process()) {
         return false;
       }
+      if (_rewrite) {
+        // Replace queued playback data from the earliest safe position on.
+        rewritten += _out.rewrite_buffers();
+      }
+      // Boost thread priority while short of slack, failure is not fatal.
+      _boost.update(
+          std::min(_in.slack(_sync_frames), _out.slack(_sync_frames)));
       if (_in.finished(_sync_frames)) {
-        _in_correction.correct(_in.balance());
+        if (_follow_master) {
+          // Recording channel or reference is master, discipline clock rate.
+          _clock.follow(_reference ? reference_balance() : _in.balance(),
+                        period);
+        }
+        _in_correction.correct(_in.balance(), reference_balance());
         if (_sync_frames + period != in_frames) {
           Log::info(
               SOSSO_LOC,
@@ -118,16 +345,39 @@ public:
               _sync_frames, in_frames - period - _sync_frames, _in.balance(),
               _in_correction.correction());
         }
-        // Period fully read, simulate consumption.
+        // Period fully read, publish or simulate consumption.
+        std::int64_t in_end = _in.end_frames();
         in_buffer = _in.take_buffer();
+        if (_alignment) {
+          _alignment->capture(1, in_buffer.data(), in_buffer.length(),
+                              _in.sample_format(), _in.channels());
+        }
+        if (companded && in_buffer.length() == linear.size()) {
+          Companding::expand(in_buffer.data(), linear.data(), linear.size(),
+                             _in.sample_format());
+          for (float sample : linear) {
+            peak = std::max(peak, std::abs(sample));
+          }
+        }
+        if constexpr (plain) {
+          if (_capture_pool) {
+            _capture_pool->publish(std::move(in_buffer), in_end);
+          }
+        }
         in_frames += period;
-        in_buffer = Buffer(in_buffer_data.data(), in_buffer_data.size());
+        in_buffer = capture_buffer(in_buffer_data);
         _in.set_buffer(std::move(in_buffer),
                        in_frames + _in_correction.correction());
+        record(FlightRecorder::correction, in_source, _sync_frames,
+               _in_correction.correction(), 0, _in.balance());
+        record(FlightRecorder::buffer, in_source, _sync_frames,
+               _in.period_end(), _in.end_frames());
+        update_margins();
+        _in_cost.periods += 1;
         ++finished;
       }
       if (_out.finished(_sync_frames)) {
-        _out_correction.correct(_out.balance());
+        _out_correction.correct(_out.balance(), reference_balance());
         if (_sync_frames + period != out_frames) {
           Log::info(
               SOSSO_LOC,
@@ -137,10 +387,28 @@ public:
         }
         // Period fully read, simulate consumption.
         out_buffer = _out.take_buffer();
+        if (_alignment) {
+          _alignment->capture(0, out_buffer.data(), out_buffer.length(),
+                              _out.sample_format(), _out.channels());
+        }
+        if constexpr (plain) {
+          if (_clip_cache) {
+            _clip_cache->release(std::move(out_buffer));
+          }
+        }
         out_frames += period;
-        out_buffer = Buffer(out_buffer_data.data(), out_buffer_data.size());
+        out_buffer = playback_buffer(out_buffer_data, _out_cost.periods + 2);
+        // Processing graph completes before the buffer is handed over.
+        if (_graph && !_graph->run(graph_budget(period))) {
+          return false;
+        }
         _out.set_buffer(std::move(out_buffer),
                         out_frames + _out_correction.correction());
+        record(FlightRecorder::correction, out_source, _sync_frames,
+               _out_correction.correction(), 0, _out.balance());
+        record(FlightRecorder::buffer, out_source, _sync_frames,
+               _out.period_end(), _out.end_frames());
+        _out_cost.periods += 1;
         ++finished;
       }
       if (!sleep()) {
@@ -153,39 +421,283 @@ public:
         _gap = 0;
       }
     }
+    latency_hold.release();
+    if (_interrupted) {
+      Log::info(SOSSO_LOC, "Run ended early by event %d, %u periods done.",
+                _events->event(0), finished);
+    }
+    if (_graph) {
+      std::uint64_t skips = 0;
+      std::uint64_t overruns = 0;
+      for (unsigned node = 0; node < _graph->nodes(); ++node) {
+        skips += _graph->skips(node);
+        overruns += _graph->overruns(node);
+      }
+      Log::info(SOSSO_LOC, "Graph nodes skipped %llu times, %llu overruns.",
+                skips, overruns);
+    }
+    if (companded) {
+      Log::info(SOSSO_LOC, "Companded recording peak at %.3f of full scale.",
+                peak);
+    }
+    if (_capture_pool && !_calibrating) {
+      Log::info(SOSSO_LOC, "Published %llu periods, %llu without buffer.",
+                _capture_pool->published(), _capture_pool->dropped());
+    }
+    if (_rewrite) {
+      Log::info(SOSSO_LOC, "Rewrote %lld frames of queued playback data.",
+                rewritten);
+    }
+    if (_boost.boosts() > 0) {
+      Log::info(SOSSO_LOC, "Thread priority boosted %llu times.",
+                _boost.boosts());
+    }
+    _in_cost.ioctls = _in.ioctl_count() - in_ioctls;
+    _in_cost.lost = _in.total_loss();
+    _out_cost.ioctls = _out.ioctl_count() - out_ioctls;
+    _out_cost.lost = _out.total_loss();
+    if (_start_delay > 0) {
+      Log::info(SOSSO_LOC, "Start error in %lld out %lld frames.",
+                _in.start_error(), _out.start_error());
+    }
+    const Distribution &latency = _clock.wakeup_latency();
+    Log::info(SOSSO_LOC,
+              "Wakeup latency median %lld ns, 99.9%% %lld ns, max %lld ns, "
+              "compensation %lld ns.",
+              latency.quantile(0.5), latency.quantile(0.999), latency.max(),
+              _clock.wakeup_compensation());
+    if (RealtimeCheck::violations() > 0) {
+      Log::warn(SOSSO_LOC, "Detected %llu real-time violations.",
+                RealtimeCheck::violations());
+    }
+    for (unsigned fault = 0; fault < FaultInjection::faults; ++fault) {
+      const FaultInjection::Recovery &recovery =
+          _faults.recovery(FaultInjection::Fault(fault));
+      if (recovery.recovered > 0) {
+        Log::info(SOSSO_LOC,
+                  "Fault %s injected %llu, lost %lld frames, %llu wakeups, "
+                  "%lld frames (max %lld) to recover on average.",
+                  FaultInjection::fault_name(fault), recovery.injected,
+                  recovery.frames_lost / std::int64_t(recovery.recovered),
+                  recovery.wakeups / recovery.recovered,
+                  recovery.time / std::int64_t(recovery.recovered),
+                  recovery.max_time);
+      }
+    }
+    if (_clock.following()) {
+      Log::info(SOSSO_LOC, "Clock rate follows master at %.1f ppm.",
+                (_clock.rate_ratio() - 1.0) * 1e6);
+      _clock.stop_following();
+    }
     _in.memory_unmap();
     _out.memory_unmap();
     return true;
   }
 
 private:
-  bool process() {
-    // Read and write as much as currently possible, at most one period.
-    if (_in.wakeup_time(_sync_frames) <= _sync_frames &&
-        !_in.process(_sync_frames)) {
+  struct PathCost {
+    std::int64_t cpu_ns = 0;
+    std::uint64_t ioctls = 0;
+    std::int64_t lost = 0;
+    std::uint64_t periods = 0;
+
+    std::int64_t cpu_per_period() const {
+      return periods > 0 ? cpu_ns / std::int64_t(periods) : 0;
+    }
+
+    double ioctls_per_period() const {
+      return periods > 0 ? double(ioctls) / periods : 0;
+    }
+  };
+
+  // Prefer memory map unless read / write loses less or costs less CPU.
+  static bool cheaper(const PathCost &mapped, const PathCost &read_write) {
+    if (mapped.lost != read_write.lost) {
+      return mapped.lost < read_write.lost;
+    }
+    return mapped.cpu_per_period() <= read_write.cpu_per_period();
+  }
+
+  static std::int64_t thread_cpu_time() {
+    timespec time = {0, 0};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+  }
+
+  bool scheduled_start(int sync_group_id) {
+    // Initialize clock first, then schedule start after the delay.
+    std::int64_t start = 0;
+    if (!_clock.init_clock(_in.sample_rate()) || !_clock.now(start)) {
+      return false;
+    }
+    start += _start_delay;
+    start -= start % _in.stepping();
+    _in.schedule_start(start);
+    _out.schedule_start(start);
+    // Prefill the playback buffer before the device is started. Processing
+    // at the scheduled start skips the progress check, see schedule_start().
+    if (!_out.process(start)) {
       return false;
     }
-    if (_out.wakeup_time(_sync_frames) <= _sync_frames &&
-        !_out.process(_sync_frames)) {
+    // Sleep, spin the last step to be precise, then trigger the start.
+    if (!_clock.wait(start, _in.stepping()) ||
+        !_in.start_sync_group(sync_group_id)) {
       return false;
     }
+    _sync_frames = start;
+    return true;
+  }
+
+  std::int64_t reference_balance() {
+    std::int64_t balance = 0;
+    if (_reference && !_reference->balance(_clock, _sync_frames, balance)) {
+      Log::warn(SOSSO_LOC, "Reference clock not available.");
+    }
+    return balance;
+  }
+
+  void record(FlightRecorder::Event event, unsigned source, std::int64_t time,
+              std::int64_t value, std::int64_t position,
+              std::int64_t balance = 0) {
+    if (_calibrating) {
+      return;
+    }
+    FlightRecord record;
+    record.time = time;
+    record.value = value;
+    record.position = position;
+    record.balance = balance;
+    record.event = event;
+    record.source = source;
+    if (event == FlightRecorder::deadline) {
+      _recorder.trigger(record);
+    } else {
+      _recorder.record(record);
+    }
+  }
+
+  void update_margins() {
+    if (!_margins.enabled() || _sync_frames <= 0) {
+      return;
+    }
+    // Wakeups per hour, as measured since start.
+    double hour_frames = 3600.0 * _clock.sample_rate();
+    double wakeups_per_hour = _wakeups * hour_frames / _sync_frames;
+    double quantile = _margins.quantile(wakeups_per_hour);
+    std::int64_t margin = _margins.margin(_lateness, wakeups_per_hour) +
+                          _margins.margin(_duration, wakeups_per_hour);
+    _in.set_margin_quantile(quantile);
+    _out.set_margin_quantile(quantile);
+    _in.set_wakeup_margin(margin);
+    _out.set_wakeup_margin(margin);
+  }
+
+  bool process() {
+    // Measure processing duration for safety margins.
+    std::int64_t begin = 0;
+    if (!_clock.now(begin)) {
+      return false;
+    }
+    {
+      // Channel processing has to be real-time safe.
+      RealtimeScope realtime;
+      // Read and write as much as currently possible, at most one period.
+      std::int64_t cpu_begin = thread_cpu_time();
+      if (_in.wakeup_time(_sync_frames) <= _sync_frames &&
+          !_in.process(_sync_frames)) {
+        return false;
+      }
+      std::int64_t cpu_split = thread_cpu_time();
+      if (_out.wakeup_time(_sync_frames) <= _sync_frames &&
+          !_out.process(_sync_frames)) {
+        return false;
+      }
+      _in_cost.cpu_ns += cpu_split - cpu_begin;
+      _out_cost.cpu_ns += thread_cpu_time() - cpu_split;
+    }
     _in.log_state(_sync_frames);
     _out.log_state(_sync_frames);
+    std::int64_t end = 0;
+    if (!_clock.now(end)) {
+      return false;
+    }
+    _duration.add(end - begin);
     return true;
   }
 
+  // Next capture buffer, from the capture pool while it has matching ones.
+  BufferType capture_buffer(std::vector<char> &fallback) {
+    if constexpr (plain) {
+      if (_capture_pool && !_calibrating) {
+        Buffer buffer = _capture_pool->acquire();
+        if (buffer.length() == fallback.size()) {
+          return buffer;
+        }
+        _capture_pool->discard(std::move(buffer));
+      }
+    }
+    return period_buffer(fallback, _in.frame_size());
+  }
+
+  // Playback buffer for given period, the alignment burst or the cached clip
+  // if it spans exactly one period.
+  BufferType playback_buffer(std::vector<char> &fallback,
+                             std::uint64_t index) {
+    if (_alignment) {
+      if (index == align_burst) {
+        return period_buffer(*_burst, _out.frame_size());
+      }
+    } else if constexpr (plain) {
+      if (_clip_cache) {
+        Buffer clip = _clip_cache->play(_clip_key);
+        if (clip.length() == fallback.size()) {
+          return clip;
+        }
+        _clip_cache->release(std::move(clip));
+      }
+    }
+    return period_buffer(fallback, _out.frame_size());
+  }
+
+  // Wrap period data. A SegmentedBuffer gets two adjacent halves, split at a
+  // frame boundary, so data() still covers the whole period.
+  static BufferType period_buffer(std::vector<char> &data,
+                                  std::size_t frame_size) {
+    if constexpr (plain) {
+      return Buffer(data.data(), data.size());
+    } else {
+      std::size_t half = data.size() / 2;
+      half -= half % frame_size;
+      BufferType buffer(data.data(), half);
+      buffer.add_segment(data.data() + half, data.size() - half);
+      return buffer;
+    }
+  }
+
+  // Time budget of the processing graph, half of period or slack if less.
+  std::int64_t graph_budget(std::int64_t period) const {
+    std::int64_t slack =
+        std::min(_in.slack(_sync_frames), _out.slack(_sync_frames));
+    std::int64_t budget = _clock.frames_to_time(std::min(period, slack) / 2);
+    // Zero would disable the deadline, skip all nodes instead.
+    return std::max<std::int64_t>(budget, 1);
+  }
+
   bool sleep() {
     // Compute time offset of next step.
     std::int64_t wakeup =
         std::min(_in.wakeup_time(_sync_frames), _out.wakeup_time(_sync_frames));
     if (wakeup > _sync_frames) {
-      // Sleep until next step.
-      std::int64_t sim_delay = 0;
-      if (((_sync_frames / 1024) % 8) == 7) {
-        sim_delay = 8 * 1024;
-        Log::warn(SOSSO_LOC, "Simulate late wakeup by %lld.", sim_delay);
-      }
-      if (!_clock.sleep(wakeup + sim_delay)) {
+      // Sleep until next step, or until another event ends the run.
+      if (_events) {
+        if (!_events->wait(_clock, wakeup)) {
+          return false;
+        }
+        if (!_events->deadline()) {
+          _interrupted = true;
+          return true;
+        }
+      } else if (!_clock.sleep(wakeup)) {
         return false;
       }
       _sync_frames = wakeup;
@@ -197,7 +709,15 @@ private:
     }
     // Correct current frame time if we are late.
     std::int64_t sync_diff = now - _sync_frames;
+    _lateness.add(sync_diff);
+    ++_wakeups;
+    if (!_calibrating) {
+      _faults.wakeup(now, _in.total_loss() + _out.total_loss(),
+                     _in.sync_level() == 0 && _out.sync_level() == 0);
+    }
+    record(FlightRecorder::wakeup, engine_source, now, _sync_frames, 0);
     if (sync_diff > _in.stepping()) {
+      record(FlightRecorder::deadline, engine_source, now, sync_diff, 0);
       std::int64_t rounded = sync_diff - (sync_diff % _in.stepping());
       Log::info(SOSSO_LOC, "Wakeup time is %lld late, correct by %lld",
                 sync_diff, rounded);
@@ -214,11 +734,48 @@ private:
     return true;
   }
 
+  static constexpr unsigned in_source = 0;
+  static constexpr unsigned out_source = 1;
+  static constexpr unsigned engine_source = 2;
+
+  // Capture pool and clip cache apply to plain buffers only.
+  static constexpr bool plain = std::is_same_v<BufferType, Buffer>;
+
+  // Alignment captures 8 periods, with a noise burst in period 3.
+  static constexpr unsigned align_periods = 8;
+  static constexpr unsigned align_burst = 3;
+
   FrameClock _clock;
   std::int64_t _sync_frames = 0;
   std::int64_t _gap = 0;
-  DoubleBuffer<WriteChannel> _out;
-  DoubleBuffer<ReadChannel> _in;
+  std::int64_t _start_delay = 0;
+  std::int64_t _capture_offset = 0;
+  bool _follow_master = false;
+  ReferenceClock *_reference = nullptr;
+  ProcessGraph *_graph = nullptr;
+  PeriodPool *_capture_pool = nullptr;
+  ClipCache *_clip_cache = nullptr;
+  std::uint64_t _clip_key = 0;
+  Alignment *_alignment = nullptr;
+  std::vector<char> *_burst = nullptr;
+  EventWait *_events = nullptr;
+  bool _interrupted = false;
+  bool _rewrite = false;
+  std::uint64_t _wakeups = 0;
+  Distribution _lateness;
+  Distribution _duration;
+  MarginPolicy _margins;
+  PriorityBoost _boost;
+  bool _hold_latency = false;
+  FlightRecorder _recorder;
+  FaultInjection _faults;
+  bool _calibrating = false;
+  bool _in_map = true;
+  bool _out_map = true;
+  PathCost _in_cost;
+  PathCost _out_cost;
+  DoubleBuffer<WriteChannel, BufferType> _out;
+  DoubleBuffer<ReadChannel, BufferType> _in;
   Correction _out_correction;
   Correction _in_correction;
 };
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "sosso/FlightRecorder.hpp"
+#include <cstdio>
+#include <cstring>
+
+void sosso::Log::log(sosso::SourceLocation, const char *message) {
+  std::fprintf(stderr, "%s\n", message);
+}
+
+void sosso::Log::info(sosso::SourceLocation, const char *message) {
+  std::fprintf(stderr, "%s\n", message);
+}
+
+void sosso::Log::warn(sosso::SourceLocation, const char *message) {
+  std::fprintf(stderr, "Warning: %s\n", message);
+}
+
+// Decode a flight recorder dump to text, one event per line.
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::fprintf(stderr, "Usage: %s <flight recorder dump>\n", argv[0]);
+    return 1;
+  }
+  std::FILE *file = std::fopen(argv[1], "rb");
+  if (!file) {
+    std::fprintf(stderr, "Unable to open %s.\n", argv[1]);
+    return 1;
+  }
+  sosso::FlightHeader header;
+  sosso::FlightHeader expected;
+  if (std::fread(&header, sizeof(header), 1, file) != 1 ||
+      std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      header.version != expected.version ||
+      header.record_size != expected.record_size) {
+    std::fprintf(stderr, "Not a compatible flight recorder dump.\n");
+    std::fclose(file);
+    return 1;
+  }
+  double rate = header.sample_rate > 0 ? header.sample_rate : 1;
+  std::printf("Triggered by %s at %.3f ms, %u records at %u Hz.\n",
+              sosso::FlightRecorder::event_name(header.trigger_event),
+              header.trigger_time * 1000.0 / rate, header.records,
+              header.sample_rate);
+  std::printf("%12s %10s %6s %12s %12s %8s %4s\n", "time_ms", "event",
+              "source", "value", "position", "balance", "sync");
+  sosso::FlightRecord record;
+  for (unsigned i = 0; i < header.records; ++i) {
+    if (std::fread(&record, sizeof(record), 1, file) != 1) {
+      std::fprintf(stderr, "Dump truncated after %u records.\n", i);
+      break;
+    }
+    const char *mark = (record.event == header.trigger_event &&
+                        record.time == header.trigger_time)
+                           ? " <"
+                           : "";
+    std::printf("%12.3f %10s %6u %12lld %12lld %8lld %4d%s\n",
+                record.time * 1000.0 / rate,
+                sosso::FlightRecorder::event_name(record.event),
+                unsigned(record.source), (long long)record.value,
+                (long long)record.position, (long long)record.balance,
+                int(record.sync_level), mark);
+  }
+  std::fclose(file);
+  return 0;
+}
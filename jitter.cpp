@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "sosso/Distribution.hpp"
+#include "sosso/FrameClock.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#if defined(__FreeBSD__)
+#include <pthread_np.h>
+#include <sys/cpuset.h>
+typedef cpuset_t cpu_set_t;
+#endif
+
+void sosso::Log::log(sosso::SourceLocation, const char *message) {
+  std::fprintf(stderr, "%s\n", message);
+}
+
+void sosso::Log::info(sosso::SourceLocation, const char *message) {
+  std::fprintf(stderr, "%s\n", message);
+}
+
+void sosso::Log::warn(sosso::SourceLocation, const char *message) {
+  std::fprintf(stderr, "Warning: %s\n", message);
+}
+
+namespace {
+
+// Measurement settings, from command line options.
+struct Settings {
+  unsigned rate = 48000; // Sample rate in Hz.
+  unsigned step = 0;     // Wakeup step in frames, 0 for clock stepping.
+  unsigned seconds = 10; // Measurement duration per CPU.
+  unsigned load = 0;     // Number of load threads.
+  int priority = 0;      // SCHED_FIFO priority, 0 for normal scheduling.
+  int cpu = -1;          // Single CPU to measure, -1 for all CPUs.
+  double quantile = 0;   // Wakeup compensation quantile, 0 to disable.
+};
+
+// Wakeup measurement of one CPU.
+struct Result {
+  int cpu = 0;                  // Measured CPU.
+  bool valid = false;           // Measurement completed.
+  sosso::Distribution latency;  // Wakeup latency in nanoseconds.
+  std::uint64_t late_steps = 0; // Wakeups late by more than one step.
+};
+
+// Bind the current thread to a single CPU.
+bool pin_thread(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (error != 0) {
+    std::fprintf(stderr, "Unable to bind to CPU %d, error %d.\n", cpu, error);
+    return false;
+  }
+  return true;
+}
+
+// Use real-time scheduling like the processing thread, if permitted.
+void set_priority(int priority) {
+  if (priority > 0) {
+    sched_param param = {};
+    param.sched_priority = priority;
+    int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (error != 0) {
+      std::fprintf(stderr, "Real-time priority denied, error %d.\n", error);
+    }
+  }
+}
+
+// Keep a CPU busy with memory traffic until stopped.
+void generate_load(std::stop_token stop) {
+  std::vector<std::uint64_t> memory(1 << 20);
+  std::uint64_t value = 1;
+  while (!stop.stop_requested()) {
+    for (std::uint64_t &word : memory) {
+      value = value * 6364136223846793005ULL + 1442695040888963407ULL;
+      word += value;
+    }
+  }
+}
+
+// Sleep in wakeup steps through FrameClock, as the engine does.
+void measure(const Settings &settings, Result &result) {
+  if (!pin_thread(result.cpu)) {
+    return;
+  }
+  set_priority(settings.priority);
+  sosso::FrameClock clock;
+  if (!clock.init_clock(settings.rate)) {
+    return;
+  }
+  clock.set_wakeup_compensation(settings.quantile);
+  std::int64_t step = settings.step ? settings.step : clock.stepping();
+  std::int64_t end = std::int64_t(settings.seconds) * settings.rate;
+  std::int64_t wakeup = step;
+  while (wakeup < end) {
+    std::int64_t now = 0;
+    if (!clock.sleep(wakeup) || !clock.now(now)) {
+      return;
+    }
+    if (now - wakeup > step) {
+      result.late_steps += 1;
+    }
+    // Skip missed steps, like the engine corrects its frame time.
+    wakeup += step;
+    if (now >= wakeup) {
+      wakeup = now - (now % step) + step;
+    }
+  }
+  result.latency = clock.wakeup_latency();
+  result.valid = true;
+}
+
+// Smallest power of two not below value.
+std::int64_t power_of_two(std::int64_t value) {
+  std::int64_t result = 1;
+  while (result < value) {
+    result <<= 1;
+  }
+  return result;
+}
+
+void usage(const char *name) {
+  std::fprintf(stderr,
+               "Usage: %s [-r rate] [-s step] [-d seconds] [-l load threads] "
+               "[-p fifo priority] [-c cpu] [-q compensation quantile]\n",
+               name);
+}
+
+} // namespace
+
+// Measure wakeup latency per CPU, recommend period and OSS buffer size.
+int main(int argc, char *argv[]) {
+  Settings settings;
+  int option = 0;
+  while ((option = getopt(argc, argv, "r:s:d:l:p:c:q:")) != -1) {
+    switch (option) {
+    case 'r':
+      settings.rate = std::strtoul(optarg, nullptr, 10);
+      break;
+    case 's':
+      settings.step = std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'd':
+      settings.seconds = std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'l':
+      settings.load = std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'p':
+      settings.priority = std::atoi(optarg);
+      break;
+    case 'c':
+      settings.cpu = std::atoi(optarg);
+      break;
+    case 'q':
+      settings.quantile = std::strtod(optarg, nullptr);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (settings.rate == 0 || settings.seconds == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Measure one CPU at a time, with load threads left to the scheduler.
+  int cpus = static_cast<int>(std::thread::hardware_concurrency());
+  std::vector<Result> results;
+  for (int cpu = 0; cpu < cpus; ++cpu) {
+    if (settings.cpu < 0 || settings.cpu == cpu) {
+      results.emplace_back();
+      results.back().cpu = cpu;
+    }
+  }
+  std::vector<std::jthread> load;
+  for (unsigned i = 0; i < settings.load; ++i) {
+    load.emplace_back(generate_load);
+  }
+  for (Result &result : results) {
+    std::thread([&settings, &result]() { measure(settings, result); }).join();
+  }
+  load.clear();
+
+  std::printf("%4s %10s %10s %10s %10s %10s %6s\n", "cpu", "wakeups",
+              "p99_us", "p99.9_us", "p99.99_us", "max_us", "late");
+  std::int64_t worst_ns = 0;
+  for (const Result &result : results) {
+    if (!result.valid) {
+      std::printf("%4d %10s\n", result.cpu, "failed");
+      continue;
+    }
+    const sosso::Distribution &latency = result.latency;
+    std::printf("%4d %10llu %10.1f %10.1f %10.1f %10.1f %6llu\n", result.cpu,
+                (unsigned long long)latency.count(),
+                latency.quantile(0.99) / 1000.0,
+                latency.quantile(0.999) / 1000.0,
+                latency.quantile(0.9999) / 1000.0, latency.max() / 1000.0,
+                (unsigned long long)result.late_steps);
+    if (latency.max() > worst_ns) {
+      worst_ns = latency.max();
+    }
+  }
+
+  // A period has to absorb the worst wakeup latency plus one wakeup step,
+  // with the same again left for processing. The OSS buffer holds a period
+  // and the latency margin on top.
+  sosso::FrameClock clock;
+  clock.set_sample_rate(settings.rate);
+  std::int64_t step = settings.step ? settings.step : clock.stepping();
+  std::int64_t worst = clock.time_to_frames(worst_ns) + 1;
+  std::int64_t period = power_of_two(2 * (worst + step));
+  std::int64_t buffer = power_of_two(period + worst + step);
+  std::printf("Worst wakeup latency %lld frames at %u Hz, step %lld.\n",
+              (long long)worst, settings.rate, (long long)step);
+  std::printf("Recommended minimum period %lld frames (%.2f ms).\n",
+              (long long)period, period * 1000.0 / settings.rate);
+  std::printf("Recommended OSS buffer size %lld frames (%.2f ms), %lld bytes "
+              "for 2 channels of 32 bit.\n",
+              (long long)buffer, buffer * 1000.0 / settings.rate,
+              (long long)buffer * 8);
+  return 0;
+}
@@ -15,8 +15,24 @@
  */
 
 #include "TestRun.hpp"
+#include "sosso/Alignment.hpp"
+#include "sosso/ClipCache.hpp"
+#include "sosso/EventWait.hpp"
 #include "sosso/Logging.hpp"
+#include "sosso/PeriodPool.hpp"
+#include "sosso/ProcessGraph.hpp"
+#include "sosso/RealtimeCheck.hpp"
+#include "sosso/ReferenceClock.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <loguru.hpp>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 void sosso::Log::log(sosso::SourceLocation location, const char *message) {
   loguru::log(loguru::Verbosity_1, location.file_name(), location.line(),
@@ -33,21 +49,372 @@ void sosso::Log::warn(sosso::SourceLocation location, const char *message) {
               message);
 }
 
+namespace {
+
+void usage(const char *name) {
+  std::fprintf(stderr,
+               "Usage: %s [options] [device]\n"
+               "  -a frames  Limit playback data queued ahead.\n"
+               "  -b         Repeat a short run with segmented buffers.\n"
+               "  -c name    Correct drift against a shared reference clock.\n"
+               "  -d frames  Start at a scheduled time, frames from now.\n"
+               "  -f format  Sample format mulaw or alaw, default native.\n"
+               "  -g workers Run a synthetic processing graph each period.\n"
+               "  -i         End the run early on input, e.g. enter key.\n"
+               "  -j fault   Inject fault:interval[:magnitude], repeatable.\n"
+               "             Faults again, interrupt, short_io, ioctl_error,\n"
+               "             pointer_jump, buffer_cycle, stalled.\n"
+               "  -l         Hold a CPU latency limit while streaming.\n"
+               "  -m         Monitor captured periods from another thread.\n"
+               "  -o         Align recordings to playback over a loopback.\n"
+               "  -p         Play a cached noise clip instead of silence.\n"
+               "  -q quant  Wake up early by this wakeup latency quantile.\n"
+               "  -r         Rewrite queued playback data after processing.\n"
+               "  -s ppm     Correct drift against a skewed, simulated "
+               "reference.\n"
+               "  -t         Follow the master clock with the clock rate.\n"
+               "  -u frames  Boost thread priority below frames of slack.\n"
+               "  -w count   Inject a late wakeup every count wakeups.\n"
+               "  -x rate    Size wakeup margins for an xrun rate per hour.\n",
+               name);
+}
+
+// Configure a fault injection given as name:interval[:magnitude].
+bool set_fault(sosso::FaultInjection &faults, const char *spec) {
+  static const char *names[sosso::FaultInjection::faults] = {
+      "again",        "interrupt",    "short_io", "ioctl_error",
+      "pointer_jump", "buffer_cycle", "stalled",  "late_wakeup"};
+  const char *colon = std::strchr(spec, ':');
+  if (!colon) {
+    return false;
+  }
+  std::size_t length = colon - spec;
+  for (unsigned fault = 0; fault < sosso::FaultInjection::faults; ++fault) {
+    if (std::strlen(names[fault]) == length &&
+        std::strncmp(spec, names[fault], length) == 0) {
+      char *end = nullptr;
+      unsigned interval = std::strtoul(colon + 1, &end, 10);
+      std::int64_t magnitude =
+          (*end == ':') ? std::strtoll(end + 1, nullptr, 10) : 0;
+      faults.set_fault(sosso::FaultInjection::Fault(fault), interval,
+                       magnitude);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Build a synthetic mixer graph, tracks are filtered in parallel and summed.
+bool build_graph(sosso::ProcessGraph &graph,
+                 std::vector<std::vector<float>> &tracks, unsigned workers) {
+  constexpr unsigned track_count = 8;
+  tracks.assign(track_count + 1, std::vector<float>(1024));
+  std::vector<float> &bus = tracks.back();
+  auto silence = [&bus]() { std::fill(bus.begin(), bus.end(), 0.0f); };
+  unsigned mix = graph.add_node(
+      [&tracks, &bus]() {
+        std::fill(bus.begin(), bus.end(), 0.0f);
+        for (unsigned t = 0; t + 1 < tracks.size(); ++t) {
+          for (std::size_t i = 0; i < bus.size(); ++i) {
+            bus[i] += tracks[t][i];
+          }
+        }
+      },
+      silence);
+  for (unsigned t = 0; t < track_count; ++t) {
+    std::vector<float> &track = tracks[t];
+    unsigned node = graph.add_node(
+        [&track, t]() {
+          // Low pass filtered noise, as a stand-in for track processing.
+          std::uint32_t seed = t + 1;
+          float state = 0;
+          for (float &sample : track) {
+            seed = seed * 1664525U + 1013904223U;
+            float noise = static_cast<std::int32_t>(seed) / 2147483648.0f;
+            state += 0.1f * (noise - state);
+            sample = state;
+          }
+        },
+        [&track]() { std::fill(track.begin(), track.end(), 0.0f); });
+    graph.connect(node, mix);
+  }
+  return graph.prepare(workers);
+}
+
+// Fetch every captured period in sequence, as a reader of the pool.
+void monitor_captures(std::stop_token stop, sosso::PeriodPool &captures,
+                      std::uint64_t &received) {
+  while (!stop.stop_requested()) {
+    sosso::SharedPeriod period = captures.fetch(received);
+    if (period.valid()) {
+      received += 1;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+} // namespace
+
 int main(int argc, char *argv[]) {
 
   loguru::g_stderr_verbosity = loguru::Verbosity_INFO;
   loguru::init(argc, argv);
 
+  long write_ahead = 0;
+  long boost_slack = 0;
+  long start_delay = 0;
+  const char *reference_name = nullptr;
+  int format = 0;
+  int graph_workers = -1;
+  double reference_skew = 0;
+  double xrun_probability = 0;
+  double compensation = 0;
+  bool simulate_reference = false;
+  bool input = false;
+  bool hold_latency = false;
+  bool monitor = false;
+  bool align = false;
+  bool segmented = false;
+  bool play_clip = false;
+  bool rewrite = false;
+  bool follow_master = false;
+  unsigned late_wakeups = 0;
+  std::vector<const char *> fault_specs;
+  const char *options = "a:bc:d:f:g:ij:lmopq:rs:tu:w:x:";
+  int option = 0;
+  while ((option = getopt(argc, argv, options)) != -1) {
+    switch (option) {
+    case 'a':
+      write_ahead = std::strtol(optarg, nullptr, 10);
+      break;
+    case 'b':
+      segmented = true;
+      break;
+    case 'c':
+      reference_name = optarg;
+      break;
+    case 'd':
+      start_delay = std::strtol(optarg, nullptr, 10);
+      break;
+    case 'f':
+      if (std::strcmp(optarg, "mulaw") == 0) {
+        format = AFMT_MU_LAW;
+      } else if (std::strcmp(optarg, "alaw") == 0) {
+        format = AFMT_A_LAW;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'g':
+      graph_workers = std::atoi(optarg);
+      break;
+    case 'i':
+      input = true;
+      break;
+    case 'j':
+      fault_specs.push_back(optarg);
+      break;
+    case 'l':
+      hold_latency = true;
+      break;
+    case 'm':
+      monitor = true;
+      break;
+    case 'o':
+      align = true;
+      break;
+    case 'p':
+      play_clip = true;
+      break;
+    case 'q':
+      compensation = std::strtod(optarg, nullptr);
+      break;
+    case 'r':
+      rewrite = true;
+      break;
+    case 's':
+      reference_skew = std::strtod(optarg, nullptr);
+      simulate_reference = true;
+      break;
+    case 't':
+      follow_master = true;
+      break;
+    case 'u':
+      boost_slack = std::strtol(optarg, nullptr, 10);
+      break;
+    case 'w':
+      late_wakeups = std::strtoul(optarg, nullptr, 10);
+      break;
+    case 'x':
+      xrun_probability = std::strtod(optarg, nullptr);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  const char *device = (optind < argc) ? argv[optind] : nullptr;
+
   LOG_F(INFO, "Starting sosso_test...");
 
-  sosso::TestRun reactor;
+  sosso::TestRun<> reactor;
+
+  // Report suppressed log messages and dump flight recorder off the realtime
+  // thread.
+  std::jthread log_flush([&reactor](std::stop_token stop) {
+    unsigned dumps = 0;
+    while (!stop.stop_requested()) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      sosso::Log::flush_suppressed();
+      if (reactor.recorder().frozen()) {
+        char path[64];
+        std::snprintf(path, sizeof(path), "sosso_flight_%u.bin", dumps++);
+        if (reactor.recorder().dump(path)) {
+          LOG_F(INFO, "Flight recorder dumped to %s.", path);
+        }
+        reactor.recorder().resume();
+      }
+    }
+  });
+
+  // Use a companded sample format, on request.
+  if (format != 0) {
+    reactor.in().set_parameters(format, reactor.in().sample_rate(),
+                                reactor.in().channels());
+    reactor.out().set_parameters(format, reactor.out().sample_rate(),
+                                 reactor.out().channels());
+  }
 
-  if (argc > 1 && reactor.in().open(argv[1]) && reactor.out().open(argv[1])) {
+  // Keep CPU idle states shallow while streaming, on request.
+  reactor.set_latency_hold(hold_latency);
+
+  // Exercise late updates of already queued playback data, on request.
+  reactor.set_rewrite(rewrite);
+
+  // Discipline the clock rate to the recording or reference clock, on request.
+  reactor.set_follow_master(follow_master);
+
+  // Raise thread priority while short of slack, on request. Drop back above
+  // twice the threshold.
+  reactor.set_priority_boost(boost_slack, 2 * boost_slack);
+
+  // Start streaming with a prefilled playback buffer at a scheduled time,
+  // on request.
+  reactor.set_start_delay(start_delay);
+
+  // Size wakeup margins from measured quantiles instead of the worst case,
+  // for an accepted xrun probability per hour, on request.
+  reactor.set_xrun_probability(xrun_probability);
+
+  // Compensate measured wakeup latency by sleeping shorter, on request.
+  reactor.set_wakeup_compensation(compensation);
+
+  // Keep playback latency low by queuing less than the OSS buffer, on request.
+  reactor.out().set_write_ahead(write_ahead);
+
+  // Simulate occasional late wakeups on request, to exercise recovery.
+  if (late_wakeups > 0) {
+    reactor.faults().set_fault(sosso::FaultInjection::late_wakeup,
+                               late_wakeups, 8 * 1024);
+  }
+
+  // Inject I/O and pointer faults on request, to exercise recovery.
+  for (const char *spec : fault_specs) {
+    if (!set_fault(reactor.faults(), spec)) {
+      LOG_F(WARNING, "Invalid fault injection %s.", spec);
+    }
+  }
+
+  // Choose memory map or read / write per device, by measured cost.
+  if (device && !reactor.calibrate(device, 1024, 16)) {
+    LOG_F(WARNING, "Calibration failed, use memory map where possible.");
+  }
+
+  // Compensate the loopback latency in recordings, on request.
+  if (device && align && !reactor.align(device, 1024)) {
+    LOG_F(WARNING, "Alignment failed, recordings are not shifted.");
+  }
+
+  if (device && reactor.in().open(device) && reactor.out().open(device)) {
     reactor.in().log_device_info();
     reactor.out().log_device_info();
+    // Share captured periods with a monitor thread, without copying.
+    sosso::PeriodPool captures;
+    std::uint64_t received = 0;
+    std::jthread monitor_thread;
+    if (monitor && captures.init(8, 1024 * reactor.in().frame_size(), 1)) {
+      reactor.set_capture_pool(&captures);
+      monitor_thread = std::jthread(monitor_captures, std::ref(captures),
+                                    std::ref(received));
+    }
+    // Play a noise clip straight from locked cache memory, on request.
+    sosso::ClipCache clips;
+    if (play_clip && clips.init(1 << 20, 4)) {
+      std::vector<char> clip(1024 * reactor.out().frame_size());
+      std::uint32_t seed = 1;
+      sosso::Alignment::test_signal(clip.data(), 1024,
+                                    reactor.out().sample_format(),
+                                    reactor.out().channels(), seed);
+      if (clips.insert(1, clip.data(), clip.size())) {
+        reactor.set_clip(&clips, 1);
+      }
+    }
+    // Wait for input along with the wakeup time, on request.
+    sosso::EventWait events;
+    if (input && events.open() && events.add(STDIN_FILENO, 0)) {
+      reactor.set_event_wait(&events);
+    }
+    // Follow an external reference clock for drift correction, on request.
+    sosso::ReferenceClock reference;
+    if (reference_name) {
+      if (reference.open(reference_name)) {
+        reactor.set_reference(&reference);
+      }
+    } else if (simulate_reference &&
+               reference.create_local(reactor.in().sample_rate()) &&
+               reference.simulate(reference_skew)) {
+      // Constant skew, extrapolated from a single timeline point.
+      reactor.set_reference(&reference);
+    }
+    // Run a processing graph for each playback period, on request.
+    sosso::ProcessGraph graph;
+    std::vector<std::vector<float>> tracks;
+    if (graph_workers >= 0) {
+      if (build_graph(graph, tracks, graph_workers)) {
+        reactor.set_graph(&graph);
+      } else {
+        LOG_F(WARNING, "Processing graph not prepared.");
+      }
+    }
     reactor.read_write(1024, 80, true);
+    reactor.set_graph(nullptr);
+    reactor.set_reference(nullptr);
+    reactor.set_event_wait(nullptr);
     reactor.close();
+    reactor.set_clip(nullptr, 0);
+    if (monitor_thread.joinable()) {
+      monitor_thread.request_stop();
+      monitor_thread.join();
+      reactor.set_capture_pool(nullptr);
+      LOG_F(INFO, "Capture monitor received %llu periods.",
+            (unsigned long long)received);
+    }
+  }
+
+  // Stream through period buffers split in two segments, on request.
+  if (device && segmented) {
+    sosso::TestRun<sosso::SegmentedBuffer> split;
+    if (split.in().open(device) && split.out().open(device)) {
+      split.read_write(1024, 16, true);
+    }
+    split.close();
   }
+  log_flush.request_stop();
+  log_flush.join();
+  sosso::Log::flush_suppressed();
 
-  return 0;
+  // Fail on real-time violations, see BUILD_REALTIME_CHECK.
+  return (sosso::RealtimeCheck::violations() > 0) ? 1 : 0;
 }
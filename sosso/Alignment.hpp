@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_ALIGNMENT_HPP
+#define SOSSO_ALIGNMENT_HPP
+
+#include "sosso/Companding.hpp"
+#include "sosso/Device.hpp"
+#include "sosso/Logging.hpp"
+#include <cmath>
+#include <cstdint>
+#include <sys/soundcard.h>
+#include <vector>
+
+namespace sosso {
+
+/*!
+ * \brief Calibrate the sample offsets between recording devices.
+ *
+ * Several recording devices capture the same test signal, e.g. a noise burst
+ * from test_signal() played through a splitter. One channel of each capture is
+ * collected here, then the offset of each device relative to the first one is
+ * estimated by cross-correlation, exact to the sample. The inner loops of the
+ * correlation are written to be vectorized by the compiler.
+ * Applied as shift of the buffer end positions, the offsets align subsequent
+ * recordings of all devices, so no alignment pass over recorded files is
+ * needed. A positive offset means the device records the signal later.
+ */
+class Alignment {
+public:
+  /*!
+   * \brief Prepare the capture of test signal recordings.
+   * \param devices Number of recording devices.
+   * \param frames Length of the captures in frames.
+   */
+  void init(unsigned devices, std::size_t frames) {
+    _captures.assign(devices, std::vector<float>());
+    for (std::vector<float> &capture : _captures) {
+      capture.reserve(frames);
+    }
+    _offsets.assign(devices, 0);
+    _frames = frames;
+  }
+
+  /*!
+   * \brief Add recorded audio data of a device to its capture.
+   * \param device Index of the recording device.
+   * \param data Recorded audio data, interleaved frames.
+   * \param bytes Length of the audio data in bytes.
+   * \param format OSS sample format of the audio data.
+   * \param channels Number of channels per frame.
+   * \param channel Channel that receives the test signal.
+   * \return Number of frames added, until the capture is complete.
+   */
+  std::size_t capture(unsigned device, const char *data, std::size_t bytes,
+                      int format, unsigned channels, unsigned channel = 0) {
+    std::size_t sample_bytes = sample_size(format);
+    if (device >= _captures.size() || sample_bytes == 0 || channels == 0 ||
+        channel >= channels) {
+      return 0;
+    }
+    std::vector<float> &capture = _captures[device];
+    std::size_t frame_bytes = sample_bytes * channels;
+    std::size_t frames = bytes / frame_bytes;
+    if (frames > _frames - capture.size()) {
+      frames = _frames - capture.size();
+    }
+    const char *sample = data + channel * sample_bytes;
+    for (std::size_t i = 0; i < frames; ++i, sample += frame_bytes) {
+      capture.push_back(to_float(sample, format));
+    }
+    return frames;
+  }
+
+  //! Indicate that captures of all devices are complete.
+  bool complete() const {
+    for (const std::vector<float> &capture : _captures) {
+      if (capture.size() < _frames) {
+        return false;
+      }
+    }
+    return !_captures.empty();
+  }
+
+  /*!
+   * \brief Estimate the offsets of all devices relative to the first one.
+   * \param max_lag Maximum offset to search for, in frames.
+   * \return True if successful, false means captures are incomplete.
+   */
+  bool estimate(std::int64_t max_lag) {
+    if (!complete() || max_lag < 0 ||
+        2 * static_cast<std::size_t>(max_lag) >= _frames) {
+      return false;
+    }
+    for (unsigned device = 1; device < _captures.size(); ++device) {
+      float peak = 0;
+      _offsets[device] = correlate(_captures[0].data(),
+                                   _captures[device].data(), _frames,
+                                   max_lag, peak);
+      Log::info(SOSSO_LOC, "Device %u offset %lld frames, correlation %.3f.",
+                device, _offsets[device], peak);
+    }
+    return true;
+  }
+
+  //! Estimated offset of a device in frames, relative to the first device.
+  std::int64_t offset(unsigned device) const {
+    return (device < _offsets.size()) ? _offsets[device] : 0;
+  }
+
+  /*!
+   * \brief Shift the buffer end positions of a device by its offset.
+   *
+   * Buffer contents are kept, call this before recording starts.
+   * \param device Index of the recording device.
+   * \param channel DoubleBuffer of the device's ReadChannel.
+   * \return True if successful.
+   */
+  template <class Channel>
+  bool apply(unsigned device, Channel &channel) const {
+    return channel.shift_buffers(offset(device));
+  }
+
+  /*!
+   * \brief Find the lag with maximum normalized cross-correlation.
+   * \param reference Reference signal.
+   * \param signal Signal to compare, same length as reference.
+   * \param length Length of the signals.
+   * \param max_lag Maximum lag to search in both directions.
+   * \param peak Set to the normalized correlation at the best lag.
+   * \return Lag of signal relative to reference, positive means later.
+   */
+  static std::int64_t correlate(const float *reference, const float *signal,
+                                std::size_t length, std::int64_t max_lag,
+                                float &peak) {
+    // Compare the middle part of reference against shifted signal.
+    std::size_t span = length - 2 * max_lag;
+    const float *middle = reference + max_lag;
+    float reference_energy = dot(middle, middle, span);
+    std::int64_t best_lag = 0;
+    peak = 0;
+    for (std::int64_t lag = -max_lag; lag <= max_lag; ++lag) {
+      const float *shifted = signal + max_lag + lag;
+      float energy = reference_energy * dot(shifted, shifted, span);
+      if (energy <= 0) {
+        continue;
+      }
+      float correlation = dot(middle, shifted, span) / std::sqrt(energy);
+      if (correlation > peak) {
+        peak = correlation;
+        best_lag = lag;
+      }
+    }
+    return best_lag;
+  }
+
+  /*!
+   * \brief Generate a pseudo-random noise test signal, sharp correlation.
+   * \param data Destination buffer for interleaved frames.
+   * \param frames Number of frames to generate.
+   * \param format OSS sample format of the destination.
+   * \param channels Number of channels, all get the same signal.
+   * \param seed Noise generator state, continues across calls.
+   */
+  static void test_signal(char *data, std::size_t frames, int format,
+                          unsigned channels, std::uint32_t &seed) {
+    std::size_t sample_bytes = sample_size(format);
+    for (std::size_t i = 0; i < frames; ++i) {
+      seed = seed * 1664525U + 1013904223U;
+      // Half scale noise, leave headroom for the playback path.
+      std::int32_t value = static_cast<std::int32_t>(seed) / 2;
+      for (unsigned c = 0; c < channels; ++c) {
+        from_int(value, data, format);
+        data += sample_bytes;
+      }
+    }
+  }
+
+private:
+  // Dot product with independent partial sums, for vectorization.
+  static float dot(const float *a, const float *b, std::size_t length) {
+    constexpr std::size_t lanes = 8;
+    float sums[lanes] = {};
+    std::size_t i = 0;
+    for (; i + lanes <= length; i += lanes) {
+      for (std::size_t l = 0; l < lanes; ++l) {
+        sums[l] += a[i + l] * b[i + l];
+      }
+    }
+    for (; i < length; ++i) {
+      sums[0] += a[i] * b[i];
+    }
+    float sum = 0;
+    for (float partial : sums) {
+      sum += partial;
+    }
+    return sum;
+  }
+
+  // Bytes per sample of supported formats, 0 if not supported.
+  static std::size_t sample_size(int format) {
+    return Device::bytes_per_sample(format);
+  }
+
+  // Indicate big endian sample format.
+  static bool big_endian(int format) {
+    return format == AFMT_S16_BE || format == AFMT_S24_BE ||
+           format == AFMT_S32_BE;
+  }
+
+  // Convert a sample to float, full scale is 1.
+  static float to_float(const char *sample, int format) {
+    if (Companding::companded(format)) {
+      float value = 0;
+      Companding::expand(sample, &value, 1, format);
+      return value;
+    }
+    std::size_t bytes = sample_size(format);
+    std::uint32_t value = 0;
+    for (std::size_t b = 0; b < bytes; ++b) {
+      std::size_t index = big_endian(format) ? b : bytes - 1 - b;
+      value = (value << 8) | static_cast<unsigned char>(sample[index]);
+    }
+    // Left align to 32 bit, keeping the sign.
+    value <<= 8 * (4 - bytes);
+    return static_cast<std::int32_t>(value) / 2147483648.0f;
+  }
+
+  // Store a 32 bit sample value in the given format.
+  static void from_int(std::int32_t value, char *sample, int format) {
+    if (Companding::companded(format)) {
+      Companding::compress(&value, sample, 1, format);
+      return;
+    }
+    std::size_t bytes = sample_size(format);
+    std::uint32_t bits = static_cast<std::uint32_t>(value) >> 8 * (4 - bytes);
+    for (std::size_t b = 0; b < bytes; ++b) {
+      std::size_t index = big_endian(format) ? bytes - 1 - b : b;
+      sample[index] = static_cast<char>(bits >> (8 * b));
+    }
+  }
+
+  std::vector<std::vector<float>> _captures; // Test signal captures.
+  std::vector<std::int64_t> _offsets;        // Estimated device offsets.
+  std::size_t _frames = 0;                   // Length of captures.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_ALIGNMENT_HPP
@@ -29,6 +29,8 @@ namespace sosso {
  * memory can be passed from one Buffer instance to another, through move
  * constructor and move assignment. This prevents multiple Buffer instances from
  * referencing the same memory.
+ * A read-only Buffer, e.g. playing from a ClipCache, never modifies its memory.
+ * Filling leaves the memory as is there, clearing and erasing report 0 bytes.
  */
 class Buffer {
 public:
@@ -43,15 +45,26 @@ public:
   Buffer(char *buffer, std::size_t length)
       : _data(buffer), _length(length), _position(0) {}
 
+  /*!
+   * \brief Construct read-only Buffer operating on given memory.
+   * \param buffer Pointer to the externally allocated memory, for playback.
+   * \param length Length of the memory dedicated to this Buffer.
+   */
+  Buffer(const char *buffer, std::size_t length)
+      : _data(const_cast<char *>(buffer)), _length(length), _position(0),
+        _read_only(true) {}
+
   /*!
    * \brief Move construct a buffer.
    * \param other Adopt memory from this Buffer, leaving it empty.
    */
   Buffer(Buffer &&other) noexcept
-      : _data(other._data), _length(other._length), _position(other._position) {
+      : _data(other._data), _length(other._length), _position(other._position),
+        _read_only(other._read_only) {
     other._data = nullptr;
     other._position = 0;
     other._length = 0;
+    other._read_only = false;
   }
 
   /*!
@@ -63,15 +76,20 @@ public:
     _data = other._data;
     _position = other._position;
     _length = other._length;
+    _read_only = other._read_only;
     other._data = nullptr;
     other._position = 0;
     other._length = 0;
+    other._read_only = false;
     return *this;
   }
 
   //! Buffer is valid if the memory is accessable.
   bool valid() const { return (_data != nullptr) && (_length > 0); }
 
+  //! Indicate that the buffer memory must not be modified.
+  bool read_only() const { return _read_only; }
+
   //! Access the underlying memory, null if invalid.
   char *data() const { return _data; }
 
@@ -87,6 +105,9 @@ public:
   //! Remaining buffer memory in bytes.
   std::size_t remaining() const { return _length - _position; }
 
+  //! Contiguous memory at read / write position, same as remaining().
+  std::size_t contiguous() const { return remaining(); }
+
   /*!
    * \brief Cap given progress by remaining buffer memory.
    * \param progress Progress in bytes.
@@ -122,10 +143,10 @@ public:
    * \brief Erase an already processed part, rewind.
    * \param begin Start position of the region to be erased.
    * \param end End position of the region to be erased.
-   * \return The number of bytes that were effectively erased.
+   * \return The number of bytes that were effectively erased, 0 if read-only.
    */
   std::size_t erase(std::size_t begin, std::size_t end) {
-    if (begin < _position && begin < end) {
+    if (begin < _position && begin < end && !_read_only) {
       if (end > _position) {
         end = _position;
       }
@@ -142,10 +163,38 @@ public:
   //! Reset the buffer position to zero.
   void reset() { _position = 0; }
 
+  //! Clear the whole buffer memory, position is unchanged.
+  void clear() { fill(0); }
+
+  //! Fill the whole buffer memory with a byte value, e.g. silence.
+  void fill(char silence) {
+    if (valid() && !_read_only) {
+      std::memset(_data, silence, _length);
+    }
+  }
+
+  /*!
+   * \brief Clear buffer memory at read / write position, without advancing.
+   * \param length Length of the memory to be cleared, in bytes.
+   * \param silence Byte value of silence, see Device::silence().
+   * \return The number of bytes that were effectively cleared, 0 if read-only.
+   */
+  std::size_t clear(std::size_t length, char silence = 0) {
+    if (_read_only) {
+      return 0;
+    }
+    length = remaining(length);
+    if (length > 0) {
+      std::memset(position(), silence, length);
+    }
+    return length;
+  }
+
 private:
   char *_data = nullptr;     // External buffer memory, null if invalid.
   std::size_t _length = 0;   // Total length of the buffer memory.
   std::size_t _position = 0; // Current read / write position.
+  bool _read_only = false;   // Memory must not be modified.
 };
 
 } // namespace sosso
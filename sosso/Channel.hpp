@@ -18,6 +18,8 @@
 #define SOSSO_CHANNEL_HPP
 
 #include "sosso/Device.hpp"
+#include "sosso/Distribution.hpp"
+#include "sosso/FlightRecorder.hpp"
 #include <algorithm>
 
 namespace sosso {
@@ -35,6 +37,17 @@ namespace sosso {
  * At device start and after loss, device progress can be irregular and is
  * temporarily decoupled from Channel progress (freewheel). Sync events are
  * required to change into normal mode which strictly follows device progress.
+ * The bounds of progress steps are widened immediately on new extremes, but
+ * slowly decay towards the extremes of recent sync windows. That way a single
+ * irregular progress step doesn't affect latency for the rest of the session.
+ * Safety margins are worst case by default. Alternatively, they can be set
+ * to a quantile of the measured progress steps, plus an external margin for
+ * wakeup lateness and processing time, see MarginPolicy. These margins only
+ * affect wakeup times, recording latency follows the decaying maximum
+ * progress step, see ReadChannel.
+ * Progress and loss events can be recorded to a FlightRecorder, where loss
+ * triggers a dump of the recent history. Checks without progress are not
+ * recorded, the wakeups of the processing thread mark them well enough.
  */
 class Channel : public Device {
 public:
@@ -52,8 +65,15 @@ public:
     _balance = 0;
     _min_progress = 0;
     _max_progress = 0;
+    _window_min = 0;
+    _window_max = 0;
+    _window_syncs = 0;
+    _progress_steps.clear();
     _total_loss = 0;
     _sync_level = 8;
+    _scheduled_start = 0;
+    _start_error = 0;
+    _start_pending = false;
     return Device::open(device, mode);
   }
 
@@ -69,12 +89,55 @@ public:
   //! Last time the Channel was processed (mark_progress()).
   std::int64_t last_processing() const { return _last_processing; }
 
-  //! Maximum progress step encountered.
+  //! Maximum progress step encountered, decaying over sync windows.
   std::int64_t max_progress() const { return _max_progress; }
 
-  //! Minimum progress step encountered.
+  //! Minimum progress step encountered, decaying over sync windows.
   std::int64_t min_progress() const { return _min_progress; }
 
+  /*!
+   * \brief Set the window length for decay of the progress step bounds.
+   * \param syncs Number of syncs per window, 0 means no decay at all.
+   */
+  void set_progress_window(unsigned syncs) { _progress_window = syncs; }
+
+  //! Distribution of progress steps encountered on sync.
+  const Distribution &progress_steps() const { return _progress_steps; }
+
+  /*!
+   * \brief Set the quantile of progress steps used as safety margin.
+   * \param quantile Quantile of progress steps, 1 means max_progress().
+   */
+  void set_margin_quantile(double quantile) { _margin_quantile = quantile; }
+
+  /*!
+   * \brief Set a safety margin for wakeup lateness and processing time.
+   * \param frames Margin in frames, applied to safe wakeup times.
+   */
+  void set_wakeup_margin(std::int64_t frames) { _wakeup_margin = frames; }
+
+  //! Safety margin for progress steps, never exceeds max_progress().
+  std::int64_t progress_margin() const {
+    if (_margin_quantile >= 1.0) {
+      return max_progress();
+    }
+    std::int64_t margin = _progress_steps.quantile(_margin_quantile);
+    return std::min(margin, max_progress());
+  }
+
+  //! Safety margin for wakeup lateness and processing time.
+  std::int64_t wakeup_margin() const { return _wakeup_margin; }
+
+  /*!
+   * \brief Record progress and loss events to a flight recorder.
+   * \param recorder Flight recorder, nullptr to disable recording.
+   * \param source Source id of this channel in the records.
+   */
+  void set_recorder(FlightRecorder *recorder, unsigned source) {
+    _recorder = recorder;
+    _recorder_source = source;
+  }
+
   //! Current number of syncs required to change to normal mode.
   unsigned sync_level() const { return _sync_level; }
 
@@ -90,6 +153,28 @@ public:
   //! Total number of frames lost due to over- or underruns.
   std::int64_t total_loss() const { return _total_loss; }
 
+  /*!
+   * \brief Prepare the Channel for a device start at a scheduled frame time.
+   *
+   * Channel progress is expected to start at the scheduled frame time instead
+   * of time zero. The actual start time is measured from the first progress,
+   * and the difference is taken into account as balance.
+   * Last processing time is set to the start, so processing at exactly that
+   * time skips the progress check. This lets a playback channel be prefilled
+   * by processing at the start time before the device is started.
+   * \param start Scheduled start in external frame time, see FrameClock.
+   */
+  void schedule_start(std::int64_t start) {
+    _scheduled_start = start;
+    _start_error = 0;
+    _start_pending = true;
+    _balance = start;
+    _last_processing = start;
+  }
+
+  //! Measured start time minus scheduled start time, in frames.
+  std::int64_t start_error() const { return _start_error; }
+
   //! Next time a device progress could be expected.
   std::int64_t next_min_progress() const {
     return _last_progress + _min_progress + _balance;
@@ -98,7 +183,7 @@ public:
   //! Calculate safe wakeup time to avoid over- or underruns.
   std::int64_t safe_wakeup(std::int64_t oss_available) const {
     return next_min_progress() + buffer_frames() - oss_available -
-           max_progress();
+           progress_margin() - wakeup_margin();
   }
 
   //! Estimate the time to expect over- or underruns.
@@ -118,7 +203,7 @@ public:
     std::int64_t wakeup = _last_processing + Device::stepping();
     if (freewheel() || full_resync()) {
       // Small steps when doing a full resync.
-    } else if (resync() || wakeup + max_progress() > sync_target) {
+    } else if (resync() || wakeup + progress_margin() > sync_target) {
       // Sync required, wake up prior to next progress if possible.
       if (next_min_progress() > wakeup) {
         wakeup = next_min_progress() - Device::stepping();
@@ -127,7 +212,7 @@ public:
       }
     } else {
       // Sleep until prior to sync target, then sync again.
-      wakeup = sync_target - max_progress();
+      wakeup = sync_target - progress_margin();
     }
     // Make sure we wake up at sync target.
     if (sync_target > _last_processing && sync_target < wakeup) {
@@ -145,6 +230,13 @@ protected:
   // Account for progress detected, at current time.
   void mark_progress(std::int64_t progress, std::int64_t now) {
     if (progress > 0) {
+      record(FlightRecorder::progress, now, progress);
+      if (_start_pending) {
+        // First progress after scheduled start, measure actual start time.
+        _balance = now - (_last_progress + progress);
+        _start_error = _balance - _scheduled_start;
+        _start_pending = false;
+      }
       if (freewheel()) {
         // Some cards show irregular progress at the beginning, correct that.
         // Also correct loss after under- and overruns, assume same balance.
@@ -160,12 +252,7 @@ protected:
         if (_sync_level > 0) {
           _sync_level -= 1;
         }
-        if (progress < _min_progress || _min_progress == 0) {
-          _min_progress = progress;
-        }
-        if (progress > _max_progress) {
-          _max_progress = progress;
-        }
+        track_progress(progress);
       } else {
         // Big step with progress but no sync, requires a resync.
         _sync_level += 1;
@@ -179,12 +266,15 @@ protected:
   std::int64_t mark_loss(std::int64_t progress, std::int64_t now) {
     // Estimate frames lost due to over- or underrun.
     std::int64_t loss = (now - _balance) - (_last_progress + progress);
-    return mark_loss(loss);
+    return account_loss(loss, now);
   }
 
-  // Account for loss.
-  std::int64_t mark_loss(std::int64_t loss) {
+  // Account for loss detected, at current time.
+  std::int64_t account_loss(std::int64_t loss, std::int64_t now) {
     if (loss > 0) {
+      if (_recorder) {
+        _recorder->trigger(flight_record(FlightRecorder::loss, now, loss));
+      }
       _total_loss += loss;
       // Resync OSS progress to frame time (now) to recover from loss.
       _sync_level = std::max(_sync_level, 6U);
@@ -194,15 +284,78 @@ protected:
     return loss;
   }
 
+  // Record an event to the flight recorder, if set.
+  void record(FlightRecorder::Event event, std::int64_t now,
+              std::int64_t value) {
+    if (_recorder) {
+      _recorder->record(flight_record(event, now, value));
+    }
+  }
+
 private:
+  // Compose a flight record with current channel state.
+  FlightRecord flight_record(FlightRecorder::Event event, std::int64_t now,
+                             std::int64_t value) const {
+    FlightRecord record;
+    record.time = now;
+    record.value = value;
+    record.position = _last_progress;
+    record.balance = _balance;
+    record.sync_level = _sync_level;
+    record.event = event;
+    record.source = _recorder_source;
+    return record;
+  }
+
+  // Track bounds of progress steps, let them decay after each sync window.
+  void track_progress(std::int64_t progress) {
+    // Follow new extremes immediately, to stay on the safe side.
+    if (progress < _min_progress || _min_progress == 0) {
+      _min_progress = progress;
+    }
+    if (progress > _max_progress) {
+      _max_progress = progress;
+    }
+    if (progress < _window_min || _window_min == 0) {
+      _window_min = progress;
+    }
+    if (progress > _window_max) {
+      _window_max = progress;
+    }
+    _progress_steps.add(progress);
+    _window_syncs += 1;
+    if (_progress_window > 0 && _window_syncs >= _progress_window) {
+      // Slowly decay the bounds towards the extremes of this window, round
+      // up to reach them eventually.
+      _max_progress -= (_max_progress - _window_max + 3) / 4;
+      _min_progress += (_window_min - _min_progress + 3) / 4;
+      _window_min = 0;
+      _window_max = 0;
+      _window_syncs = 0;
+    }
+  }
+
   std::int64_t _last_processing = 0; // Last processing time.
   std::int64_t _last_sync = 0;       // Last sync time.
   std::int64_t _last_progress = 0;   // Total device progress.
   std::int64_t _balance = 0;         // Channel drift.
   std::int64_t _min_progress = 0;    // Minimum progress step encountered.
   std::int64_t _max_progress = 0;    // Maximum progress step encountered.
+  std::int64_t _window_min = 0;      // Minimum progress step in sync window.
+  std::int64_t _window_max = 0;      // Maximum progress step in sync window.
+  unsigned _window_syncs = 0;        // Syncs in current window.
+  unsigned _progress_window = 256;   // Syncs per window for bound decay.
+  Distribution _progress_steps;      // Progress steps encountered on sync.
+  double _margin_quantile = 1.0;     // Quantile of steps for safety margin.
+  std::int64_t _wakeup_margin = 0;   // Margin for lateness and processing.
   std::int64_t _total_loss = 0;      // Total loss due to over- or underruns.
+  std::int64_t _scheduled_start = 0; // Scheduled start in frame time.
+  std::int64_t _start_error = 0;     // Measured start error in frames.
+  bool _start_pending = false;       // Scheduled start not measured yet.
   unsigned _sync_level = 0;          // Syncs required.
+
+  FlightRecorder *_recorder = nullptr; // Flight recorder, optional.
+  unsigned _recorder_source = 0;       // Source id in flight records.
 };
 
 } // namespace sosso
@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_CLIPCACHE_HPP
+#define SOSSO_CLIPCACHE_HPP
+
+#include "sosso/Buffer.hpp"
+#include "sosso/Logging.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <vector>
+
+namespace sosso {
+
+/*!
+ * \brief RAM resident cache of audio clips, played without copying.
+ *
+ * Holds decoded clips like jingles in the native frame format of a playback
+ * device, in memory that is locked against paging. Playing a cached clip hands
+ * out a read-only Buffer that points straight into the cache, to be set on a
+ * DoubleBuffer<WriteChannel>. The only copy left is into the OSS buffer.
+ * When the cache is full, inserting a clip evicts the least recently played
+ * clips that are neither pinned nor currently playing.
+ * Clips are inserted, pinned and removed by a single loader thread, which may
+ * allocate. Playing and releasing clips is lock-free and real-time safe, and
+ * may happen concurrently on the processing thread.
+ */
+class ClipCache {
+  // Clip record, clip data is stored in the cache memory.
+  struct Entry {
+    std::atomic<unsigned> users{0};     // Playing buffers, or evicting.
+    std::atomic<bool> ready{false};     // Clip data valid.
+    std::atomic<std::uint64_t> key{0};  // Clip key.
+    std::atomic<std::uint64_t> used{0}; // Last play, for LRU eviction.
+    std::size_t offset = 0;             // Clip data offset in cache memory.
+    std::size_t length = 0;             // Length of clip data.
+    bool pinned = false;                // Never evicted.
+  };
+
+public:
+  //! Always close the cache before destruction.
+  ~ClipCache() { close(); }
+
+  /*!
+   * \brief Allocate and lock the cache memory, not real-time safe.
+   * \param capacity Size of the cache memory in bytes.
+   * \param clips Maximum number of cached clips.
+   * \return True if successful, memory may still be unlocked, see locked().
+   */
+  bool init(std::size_t capacity, unsigned clips) {
+    close();
+    if (capacity == 0 || clips == 0) {
+      return false;
+    }
+    void *memory = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (memory == MAP_FAILED) {
+      Log::warn(SOSSO_LOC, "Unable to allocate clip cache, error %d.", errno);
+      return false;
+    }
+    _memory = static_cast<char *>(memory);
+    _capacity = capacity;
+    _locked = (mlock(_memory, _capacity) == 0);
+    if (!_locked) {
+      Log::warn(SOSSO_LOC, "Unable to lock clip cache memory, error %d.",
+                errno);
+    }
+    _entries = std::make_unique<Entry[]>(clips);
+    _clips = clips;
+    _evictions = 0;
+    return true;
+  }
+
+  //! Release the cache memory, no clip may be playing.
+  void close() {
+    if (_memory) {
+      if (_locked) {
+        munlock(_memory, _capacity);
+      }
+      munmap(_memory, _capacity);
+    }
+    _memory = nullptr;
+    _capacity = 0;
+    _locked = false;
+    _entries.reset();
+    _clips = 0;
+  }
+
+  //! Size of the cache memory in bytes.
+  std::size_t capacity() const { return _capacity; }
+
+  //! Indicate that the cache memory is locked against paging.
+  bool locked() const { return _locked; }
+
+  //! Number of clips evicted to make room for others.
+  std::uint64_t evictions() const { return _evictions; }
+
+  //! Indicate that a clip is cached and can be played.
+  bool contains(std::uint64_t key) const { return find(key) < _clips; }
+
+  /*!
+   * \brief Cache a decoded clip, loader thread only.
+   * \param key Clip key chosen by the application.
+   * \param data Clip data in the native frame format of the device.
+   * \param length Length of the clip data in bytes.
+   * \return True if cached, false means the clip doesn't fit.
+   */
+  bool insert(std::uint64_t key, const char *data, std::size_t length) {
+    if (contains(key)) {
+      return true;
+    }
+    if (!_memory || length == 0 || length > _capacity) {
+      return false;
+    }
+    // Choose clips to evict in LRU order until there's room, then claim all
+    // of them before evicting any. Fail without eviction if there's no room.
+    std::vector<unsigned> victims;
+    std::size_t offset = 0;
+    unsigned index = free_entry();
+    while ((index >= _clips && victims.empty()) ||
+           !find_space(length, offset, victims)) {
+      unsigned victim = least_recent(victims);
+      if (victim >= _clips) {
+        Log::warn(SOSSO_LOC, "No room for clip %llu of %lu bytes in cache.",
+                  key, length);
+        return false;
+      }
+      victims.push_back(victim);
+    }
+    for (std::size_t claimed = 0; claimed < victims.size(); ++claimed) {
+      if (!claim(victims[claimed])) {
+        // Started playing meanwhile, give back the claimed clips.
+        for (std::size_t v = 0; v < claimed; ++v) {
+          _entries[victims[v]].users.store(0, std::memory_order_release);
+        }
+        Log::warn(SOSSO_LOC, "Clip cache busy, clip %llu not inserted.", key);
+        return false;
+      }
+    }
+    for (unsigned victim : victims) {
+      evict_claimed(victim);
+    }
+    if (index >= _clips) {
+      index = free_entry();
+    }
+    // Claim the entry, data becomes visible to play() when ready. A play()
+    // that just failed on the evicted clip releases the entry immediately.
+    Entry &entry = _entries[index];
+    unsigned idle = 0;
+    while (!entry.users.compare_exchange_weak(idle, evicting,
+                                              std::memory_order_acq_rel)) {
+      idle = 0;
+    }
+    std::memcpy(_memory + offset, data, length);
+    entry.offset = offset;
+    entry.length = length;
+    entry.pinned = false;
+    entry.key.store(key, std::memory_order_relaxed);
+    entry.used.store(_plays.load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+    entry.ready.store(true, std::memory_order_release);
+    entry.users.store(0, std::memory_order_release);
+    return true;
+  }
+
+  /*!
+   * \brief Pin a clip to keep it cached, loader thread only.
+   * \param key Clip key.
+   * \param pinned True to exclude the clip from eviction, false to unpin.
+   * \return True if successful, false means the clip is not cached.
+   */
+  bool pin(std::uint64_t key, bool pinned = true) {
+    unsigned index = find(key);
+    if (index < _clips) {
+      _entries[index].pinned = pinned;
+      return true;
+    }
+    return false;
+  }
+
+  /*!
+   * \brief Remove a clip from the cache, loader thread only.
+   * \param key Clip key.
+   * \return True if removed, false means not cached or currently playing.
+   */
+  bool remove(std::uint64_t key) {
+    unsigned index = find(key);
+    return index < _clips && evict(index);
+  }
+
+  /*!
+   * \brief Play a cached clip, real-time safe.
+   * \param key Clip key.
+   * \return Read-only buffer of the clip data, invalid if not cached.
+   */
+  Buffer play(std::uint64_t key) {
+    for (unsigned index = 0; index < _clips; ++index) {
+      Entry &entry = _entries[index];
+      if (!matches(entry, key)) {
+        continue;
+      }
+      // Count as user, unless the entry is being evicted right now.
+      unsigned users = entry.users.load(std::memory_order_relaxed);
+      do {
+        if (users == evicting) {
+          break;
+        }
+      } while (!entry.users.compare_exchange_weak(users, users + 1,
+                                                  std::memory_order_acq_rel));
+      if (users == evicting) {
+        continue;
+      }
+      if (matches(entry, key)) {
+        entry.used.store(_plays.fetch_add(1, std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+        return Buffer(static_cast<const char *>(_memory + entry.offset),
+                      entry.length);
+      }
+      entry.users.fetch_sub(1, std::memory_order_release);
+    }
+    return Buffer();
+  }
+
+  /*!
+   * \brief Release a clip buffer after playback, real-time safe.
+   * \param buffer Buffer obtained from play(), left empty.
+   */
+  void release(Buffer &&buffer) {
+    Buffer clip = std::move(buffer);
+    if (!clip.valid() || clip.data() < _memory ||
+        clip.data() >= _memory + _capacity) {
+      return;
+    }
+    std::size_t offset = clip.data() - _memory;
+    for (unsigned index = 0; index < _clips; ++index) {
+      Entry &entry = _entries[index];
+      unsigned users = entry.users.load(std::memory_order_relaxed);
+      if (users > 0 && users != evicting && entry.offset == offset) {
+        entry.users.fetch_sub(1, std::memory_order_release);
+        return;
+      }
+    }
+  }
+
+private:
+  // Users value of an entry that is claimed by the loader thread.
+  static constexpr unsigned evicting = ~0U;
+
+  // Alignment of clip data in the cache memory.
+  static constexpr std::size_t alignment = 64;
+
+  // Indicate that an entry holds the clip with given key.
+  static bool matches(const Entry &entry, std::uint64_t key) {
+    return entry.ready.load(std::memory_order_acquire) &&
+           entry.key.load(std::memory_order_relaxed) == key;
+  }
+
+  // Index of the entry holding a clip, number of clips if not cached.
+  unsigned find(std::uint64_t key) const {
+    for (unsigned index = 0; index < _clips; ++index) {
+      if (matches(_entries[index], key)) {
+        return index;
+      }
+    }
+    return _clips;
+  }
+
+  // Index of an unused entry, number of clips if none.
+  unsigned free_entry() const {
+    for (unsigned index = 0; index < _clips; ++index) {
+      if (!_entries[index].ready.load(std::memory_order_acquire)) {
+        return index;
+      }
+    }
+    return _clips;
+  }
+
+  // Find the first gap in cache memory that fits the clip length, as if the
+  // given victims were evicted.
+  bool find_space(std::size_t length, std::size_t &offset,
+                  const std::vector<unsigned> &victims) const {
+    std::vector<const Entry *> cached;
+    for (unsigned index = 0; index < _clips; ++index) {
+      const Entry &entry = _entries[index];
+      if (entry.ready.load(std::memory_order_acquire) &&
+          std::find(victims.begin(), victims.end(), index) == victims.end()) {
+        cached.push_back(&entry);
+      }
+    }
+    std::sort(cached.begin(), cached.end(),
+              [](const Entry *a, const Entry *b) {
+                return a->offset < b->offset;
+              });
+    std::size_t begin = 0;
+    for (const Entry *entry : cached) {
+      if (entry->offset >= begin + length) {
+        break;
+      }
+      begin = align(entry->offset + entry->length);
+    }
+    offset = begin;
+    return begin + length <= _capacity;
+  }
+
+  // Round up to the clip data alignment.
+  static std::size_t align(std::size_t offset) {
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  // Indicate that a clip is neither pinned nor playing.
+  static bool evictable(const Entry &entry) {
+    return !entry.pinned && entry.users.load(std::memory_order_relaxed) == 0;
+  }
+
+  // Least recently played clip that is not pinned, playing or already chosen
+  // as victim, number of clips if none.
+  unsigned least_recent(const std::vector<unsigned> &victims) const {
+    unsigned oldest = _clips;
+    for (unsigned index = 0; index < _clips; ++index) {
+      const Entry &entry = _entries[index];
+      if (entry.ready.load(std::memory_order_acquire) && evictable(entry) &&
+          std::find(victims.begin(), victims.end(), index) == victims.end() &&
+          (oldest >= _clips || entry.used.load(std::memory_order_relaxed) <
+                                   _entries[oldest].used.load(
+                                       std::memory_order_relaxed))) {
+        oldest = index;
+      }
+    }
+    return oldest;
+  }
+
+  // Evict a clip unless it is currently playing.
+  bool evict(unsigned index) {
+    if (!claim(index)) {
+      return false;
+    }
+    evict_claimed(index);
+    return true;
+  }
+
+  // Claim a clip for eviction, fails if it is currently playing.
+  bool claim(unsigned index) {
+    unsigned idle = 0;
+    return _entries[index].users.compare_exchange_strong(
+        idle, evicting, std::memory_order_acq_rel);
+  }
+
+  // Evict a claimed clip, its entry becomes unused.
+  void evict_claimed(unsigned index) {
+    Entry &entry = _entries[index];
+    entry.ready.store(false, std::memory_order_release);
+    entry.pinned = false;
+    entry.users.store(0, std::memory_order_release);
+    _evictions += 1;
+  }
+
+  char *_memory = nullptr;              // Locked cache memory.
+  std::size_t _capacity = 0;            // Size of cache memory in bytes.
+  bool _locked = false;                 // Cache memory locked.
+  std::unique_ptr<Entry[]> _entries;    // Clip records.
+  unsigned _clips = 0;                  // Maximum number of clips.
+  std::atomic<std::uint64_t> _plays{0}; // Number of plays, LRU clock.
+  std::uint64_t _evictions = 0;         // Number of evicted clips.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_CLIPCACHE_HPP
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_COMPANDING_HPP
+#define SOSSO_COMPANDING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/soundcard.h>
+
+namespace sosso {
+
+/*!
+ * \brief Convert between companded G.711 samples and linear client formats.
+ *
+ * Devices opened with AFMT_MU_LAW or AFMT_A_LAW sample format transfer one
+ * byte per sample. These bulk conversions expand the bytes to 16 bit, 32 bit
+ * or float samples, and compress them back, bit exact with the G.711 reference
+ * implementation. Both directions are plain table lookups: Expansion indexes
+ * a 256 entry table by the sample byte, compression indexes a table by the
+ * 14 bit (mu-law) or 13 bit (A-law) linear value. The loops have no branches.
+ * Expansion tables have 32 bit entries, so the compiler can vectorize with
+ * gather instructions where available. Compression tables are kept at one byte
+ * per entry to stay cache friendly. All tables are computed at compile time.
+ */
+class Companding {
+public:
+  //! Indicate that an OSS sample format is companded.
+  static bool companded(int format) {
+    return format == AFMT_MU_LAW || format == AFMT_A_LAW;
+  }
+
+  /*!
+   * \brief Expand companded samples to 16 bit linear samples.
+   * \param in Companded samples, one byte each.
+   * \param out Destination for linear samples.
+   * \param samples Number of samples to convert.
+   * \param format Companded OSS sample format.
+   */
+  static void expand(const char *in, std::int16_t *out, std::size_t samples,
+                     int format) {
+    const std::int32_t *table = expand_table(format);
+    for (std::size_t i = 0; i < samples; ++i) {
+      out[i] = static_cast<std::int16_t>(table[byte(in[i])]);
+    }
+  }
+
+  /*!
+   * \brief Expand companded samples to left aligned 32 bit linear samples.
+   * \param in Companded samples, one byte each.
+   * \param out Destination for linear samples.
+   * \param samples Number of samples to convert.
+   * \param format Companded OSS sample format.
+   */
+  static void expand(const char *in, std::int32_t *out, std::size_t samples,
+                     int format) {
+    const std::int32_t *table = expand_table(format);
+    for (std::size_t i = 0; i < samples; ++i) {
+      out[i] = static_cast<std::int32_t>(
+          static_cast<std::uint32_t>(table[byte(in[i])]) << 16);
+    }
+  }
+
+  /*!
+   * \brief Expand companded samples to float samples, full scale is 1.
+   * \param in Companded samples, one byte each.
+   * \param out Destination for float samples.
+   * \param samples Number of samples to convert.
+   * \param format Companded OSS sample format.
+   */
+  static void expand(const char *in, float *out, std::size_t samples,
+                     int format) {
+    const std::int32_t *table = expand_table(format);
+    for (std::size_t i = 0; i < samples; ++i) {
+      out[i] = static_cast<float>(table[byte(in[i])]) * (1.0f / 32768.0f);
+    }
+  }
+
+  /*!
+   * \brief Compress 16 bit linear samples to companded samples.
+   * \param in Linear samples.
+   * \param out Destination for companded samples, one byte each.
+   * \param samples Number of samples to convert.
+   * \param format Companded OSS sample format.
+   */
+  static void compress(const std::int16_t *in, char *out, std::size_t samples,
+                       int format) {
+    const CompressTable table = compress_table(format);
+    for (std::size_t i = 0; i < samples; ++i) {
+      std::int32_t value = in[i];
+      out[i] = table.bytes[(value >> table.shift) & table.mask];
+    }
+  }
+
+  /*!
+   * \brief Compress left aligned 32 bit linear samples to companded samples.
+   * \param in Linear samples.
+   * \param out Destination for companded samples, one byte each.
+   * \param samples Number of samples to convert.
+   * \param format Companded OSS sample format.
+   */
+  static void compress(const std::int32_t *in, char *out, std::size_t samples,
+                       int format) {
+    const CompressTable table = compress_table(format);
+    for (std::size_t i = 0; i < samples; ++i) {
+      std::int32_t value = in[i] >> 16;
+      out[i] = table.bytes[(value >> table.shift) & table.mask];
+    }
+  }
+
+  /*!
+   * \brief Compress float samples to companded samples, clipped to full scale.
+   * \param in Float samples, full scale is 1.
+   * \param out Destination for companded samples, one byte each.
+   * \param samples Number of samples to convert.
+   * \param format Companded OSS sample format.
+   */
+  static void compress(const float *in, char *out, std::size_t samples,
+                       int format) {
+    const CompressTable table = compress_table(format);
+    for (std::size_t i = 0; i < samples; ++i) {
+      float scaled = in[i] * 32768.0f;
+      scaled = (scaled < -32768.0f) ? -32768.0f : scaled;
+      scaled = (scaled > 32767.0f) ? 32767.0f : scaled;
+      std::int32_t value = static_cast<std::int32_t>(scaled);
+      out[i] = table.bytes[(value >> table.shift) & table.mask];
+    }
+  }
+
+private:
+  // Compression table with its index range.
+  struct CompressTable {
+    const char *bytes; // Companded byte per truncated linear value.
+    int shift;         // Bits to truncate from 16 bit linear values.
+    std::int32_t mask; // Index mask of the truncated linear values.
+  };
+
+  // All conversion tables, expansion entries are 32 bit for gathers.
+  struct Tables {
+    std::int32_t mu_expand[256];
+    std::int32_t a_expand[256];
+    char mu_compress[1 << 14];
+    char a_compress[1 << 13];
+  };
+
+  // Table index of a sample byte.
+  static std::size_t byte(char sample) {
+    return static_cast<unsigned char>(sample);
+  }
+
+  // Expansion table of a companded format.
+  static const std::int32_t *expand_table(int format) {
+    return (format == AFMT_A_LAW) ? tables().a_expand : tables().mu_expand;
+  }
+
+  // Compression table of a companded format.
+  static CompressTable compress_table(int format) {
+    if (format == AFMT_A_LAW) {
+      return {tables().a_compress, 3, (1 << 13) - 1};
+    }
+    return {tables().mu_compress, 2, (1 << 14) - 1};
+  }
+
+  // G.711 mu-law byte to 16 bit linear value.
+  static constexpr std::int32_t mu_to_linear(unsigned sample) {
+    sample = ~sample & 0xFF;
+    std::int32_t value = ((sample & 0x0F) << 3) + 0x84;
+    value <<= (sample & 0x70) >> 4;
+    return (sample & 0x80) ? (0x84 - value) : (value - 0x84);
+  }
+
+  // G.711 A-law byte to 16 bit linear value.
+  static constexpr std::int32_t a_to_linear(unsigned sample) {
+    sample ^= 0x55;
+    std::int32_t value = (sample & 0x0F) << 4;
+    unsigned segment = (sample & 0x70) >> 4;
+    if (segment == 0) {
+      value += 8;
+    } else {
+      value = (value + 0x108) << (segment - 1);
+    }
+    return (sample & 0x80) ? value : -value;
+  }
+
+  // Segment of a linear value, 8 if beyond the last segment end.
+  static constexpr unsigned segment(std::int32_t value, std::int32_t end) {
+    unsigned segment = 0;
+    while (segment < 8 && value > end) {
+      segment += 1;
+      end = (end << 1) | 1;
+    }
+    return segment;
+  }
+
+  // G.711 mu-law byte from 14 bit linear value.
+  static constexpr char linear_to_mu(std::int32_t value) {
+    unsigned mask = 0xFF;
+    if (value < 0) {
+      value = -value;
+      mask = 0x7F;
+    }
+    value = (value > 8159) ? 8159 : value;
+    value += 0x84 >> 2;
+    unsigned seg = segment(value, 0x3F);
+    unsigned sample = 0x7F;
+    if (seg < 8) {
+      sample = (seg << 4) | ((value >> (seg + 1)) & 0x0F);
+    }
+    return static_cast<char>(sample ^ mask);
+  }
+
+  // G.711 A-law byte from 13 bit linear value.
+  static constexpr char linear_to_a(std::int32_t value) {
+    unsigned mask = 0xD5;
+    if (value < 0) {
+      value = -value - 1;
+      mask = 0x55;
+    }
+    unsigned seg = segment(value, 0x1F);
+    unsigned sample = 0x7F;
+    if (seg < 8) {
+      sample = (seg << 4) | ((value >> ((seg < 2) ? 1 : seg)) & 0x0F);
+    }
+    return static_cast<char>(sample ^ mask);
+  }
+
+  // Compute all conversion tables.
+  static constexpr Tables make_tables() {
+    Tables tables = {};
+    for (unsigned sample = 0; sample < 256; ++sample) {
+      tables.mu_expand[sample] = mu_to_linear(sample);
+      tables.a_expand[sample] = a_to_linear(sample);
+    }
+    // Compression tables are indexed by two's complement truncated values.
+    for (std::int32_t index = 0; index < (1 << 14); ++index) {
+      std::int32_t value = (index < (1 << 13)) ? index : index - (1 << 14);
+      tables.mu_compress[index] = linear_to_mu(value);
+    }
+    for (std::int32_t index = 0; index < (1 << 13); ++index) {
+      std::int32_t value = (index < (1 << 12)) ? index : index - (1 << 13);
+      tables.a_compress[index] = linear_to_a(value);
+    }
+    return tables;
+  }
+
+  // Conversion tables, constant initialized.
+  static const Tables &tables() {
+    static constexpr Tables tables = make_tables();
+    return tables;
+  }
+};
+
+} // namespace sosso
+
+#endif // SOSSO_COMPANDING_HPP
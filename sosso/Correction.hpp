@@ -33,6 +33,8 @@ namespace sosso {
  * or rigorous correction in case of large discrepance. The idea is that single
  * frame corrections typically go unnoticed, but it may not be sufficient to
  * correct something more grave like packet loss on a USB audio interface.
+ * With an external ReferenceClock, its balance serves as target instead, so
+ * that all channels are steered to the reference time base.
  */
 class Correction {
 public:
@@ -57,7 +59,7 @@ public:
   /*!
    * \brief Calculate a new correction parameter.
    * \param balance Balance of the corrected channel, compared to FrameClock.
-   * \param target Balance of a master channel which acts as reference.
+   * \param target Balance of a master channel or external reference clock.
    * \return Current correction parameter.
    */
   std::int64_t correct(std::int64_t balance, std::int64_t target = 0) {
@@ -17,6 +17,7 @@
 #ifndef SOSSO_DEVICE_HPP
 #define SOSSO_DEVICE_HPP
 
+#include "sosso/FaultInjection.hpp"
 #include "sosso/Logging.hpp"
 #include <cstdint>
 #include <cstring>
@@ -50,6 +51,9 @@ public:
    */
   static std::size_t bytes_per_sample(int format) {
     switch (format) {
+    case AFMT_MU_LAW:
+    case AFMT_A_LAW:
+      return 1;
     case AFMT_S16_LE:
     case AFMT_S16_BE:
       return 2;
@@ -64,6 +68,22 @@ public:
     }
   }
 
+  /*!
+   * \brief Byte value of silent samples in an OSS sample format.
+   * \param format OSS sample format, see sys/soundcard.h header.
+   * \return Silence byte, not zero for companded formats.
+   */
+  static char silence(int format) {
+    switch (format) {
+    case AFMT_MU_LAW:
+      return static_cast<char>(0xFF);
+    case AFMT_A_LAW:
+      return static_cast<char>(0xD5);
+    default:
+      return 0;
+    }
+  }
+
   //! Always close device before destruction.
   ~Device() { close(); }
 
@@ -75,6 +95,9 @@ public:
     return bytes_per_sample(_sample_format);
   }
 
+  //! Byte value of silent samples in the effective sample format.
+  char silence() const { return silence(_sample_format); }
+
   //! Indicate that the device is open.
   bool is_open() const { return _fd >= 0; }
 
@@ -217,10 +240,13 @@ public:
    */
   bool read_io(char *buffer, std::size_t length, std::size_t &count) {
     if (buffer && length > 0 && recording()) {
-      ssize_t result = ::read(_fd, buffer, length);
+      ssize_t result = io_fault(length);
+      if (result == 0) {
+        result = ::read(_fd, buffer, length);
+      }
       if (result >= 0) {
         count += result;
-      } else if (errno == EAGAIN) {
+      } else if (errno == EAGAIN || errno == EINTR) {
         count += 0;
       } else {
         Log::warn(SOSSO_LOC, "Data read failed with %d.", errno);
@@ -269,10 +295,13 @@ public:
    */
   bool write_io(char *buffer, std::size_t length, std::size_t &count) {
     if (buffer && length > 0 && playback()) {
-      ssize_t result = ::write(file_descriptor(), buffer, length);
+      ssize_t result = io_fault(length);
+      if (result == 0) {
+        result = ::write(file_descriptor(), buffer, length);
+      }
       if (result >= 0) {
         count += result;
-      } else if (errno == EAGAIN) {
+      } else if (errno == EAGAIN || errno == EINTR) {
         count += 0;
       } else {
         Log::warn(SOSSO_LOC, "Data write failed with %d.", errno);
@@ -308,11 +337,11 @@ public:
         }
         offset = 0;
       }
-      // Write source if available, otherwise clear the buffer.
+      // Write source if available, otherwise fill with silence.
       if (buffer) {
         std::memcpy(map() + offset, buffer, length);
       } else {
-        std::memset(map() + offset, 0, length);
+        std::memset(map() + offset, silence(), length);
       }
       bytes_written += length;
     }
@@ -327,12 +356,39 @@ public:
     unsigned long request =
         playback() ? SNDCTL_DSP_CURRENT_OPTR : SNDCTL_DSP_CURRENT_IPTR;
     oss_count_t ptr;
-    if (ioctl(_fd, request, &ptr) == 0) {
+    if (device_ioctl(request, &ptr) == 0) {
       return ptr.fifo_samples;
     }
     return 0;
   }
 
+  /*!
+   * \brief Query absolute sample counter and OSS buffer queue (non-mapped).
+   * \param samples Set to total frames recorded / played since start.
+   * \param queued Set to number of frames in the OSS buffer.
+   * \return True if successful.
+   */
+  bool get_sample_count(std::int64_t &samples, std::int64_t &queued) {
+    unsigned long request =
+        playback() ? SNDCTL_DSP_CURRENT_OPTR : SNDCTL_DSP_CURRENT_IPTR;
+    oss_count_t ptr;
+    if (device_ioctl(request, &ptr) == 0) {
+      samples = ptr.samples;
+      queued = ptr.fifo_samples;
+      return true;
+    }
+    return false;
+  }
+
+  //! Number of pointer and counter ioctls made, to assess processing cost.
+  std::uint64_t ioctl_count() const { return _ioctls; }
+
+  /*!
+   * \brief Inject faults into I/O and pointer queries, for testing.
+   * \param faults Fault injection, nullptr to disable.
+   */
+  void set_fault_injection(FaultInjection *faults) { _faults = faults; }
+
   //! Indicate that the device can be triggered to start.
   bool can_trigger() const { return has_capability(PCM_CAP_TRIGGER); }
 
@@ -402,7 +458,8 @@ public:
   //! Update current playback position for memory mapped OSS buffer.
   bool get_play_pointer() {
     count_info info = {};
-    if (ioctl(file_descriptor(), SNDCTL_DSP_GETOPTR, &info) == 0) {
+    if (device_ioctl(SNDCTL_DSP_GETOPTR, &info) == 0) {
+      pointer_fault(info);
       if (info.ptr >= 0 && static_cast<unsigned>(info.ptr) < buffer_size() &&
           (info.ptr % frame_size()) == 0 && info.blocks >= 0) {
         // Calculate pointer delta without complete buffer cycles.
@@ -435,7 +492,8 @@ public:
   //! Update current recording position for memory mapped OSS buffer.
   bool get_rec_pointer() {
     count_info info = {};
-    if (ioctl(file_descriptor(), SNDCTL_DSP_GETIPTR, &info) == 0) {
+    if (device_ioctl(SNDCTL_DSP_GETIPTR, &info) == 0) {
+      pointer_fault(info);
       if (info.ptr >= 0 && static_cast<unsigned>(info.ptr) < buffer_size() &&
           (info.ptr % frame_size()) == 0 && info.blocks >= 0) {
         // Calculate pointer delta without complete buffer cycles.
@@ -649,6 +707,52 @@ private:
     return false;
   }
 
+  // Ioctl used during processing, counted and subject to fault injection.
+  int device_ioctl(unsigned long request, void *argument) {
+    _ioctls += 1;
+    if (_faults && _faults->inject(FaultInjection::ioctl_error)) {
+      errno = EIO;
+      return -1;
+    }
+    return ioctl(_fd, request, argument);
+  }
+
+  // Inject I/O faults, shorten the length or return -1 with errno set.
+  ssize_t io_fault(std::size_t &length) {
+    if (_faults) {
+      if (_faults->inject(FaultInjection::again)) {
+        errno = EAGAIN;
+        return -1;
+      }
+      if (_faults->inject(FaultInjection::interrupt)) {
+        errno = EINTR;
+        return -1;
+      }
+      if (length >= 2 * frame_size() &&
+          _faults->inject(FaultInjection::short_io)) {
+        length = (length / 2) - ((length / 2) % frame_size());
+      }
+    }
+    return 0;
+  }
+
+  // Inject pointer faults into memory map pointer query results.
+  void pointer_fault(count_info &info) {
+    if (!_faults || buffer_size() == 0 || _fragment_size == 0) {
+      return;
+    }
+    if (_faults->inject(FaultInjection::pointer_jump)) {
+      std::int64_t jump = _faults->magnitude(FaultInjection::pointer_jump);
+      info.ptr = (info.ptr + jump * frame_size()) % buffer_size();
+      info.blocks += (jump * frame_size()) / _fragment_size;
+    } else if (_faults->inject(FaultInjection::buffer_cycle)) {
+      info.blocks += buffer_size() / _fragment_size;
+    } else if (_faults->inject(FaultInjection::stalled)) {
+      info.ptr = map_pointer();
+      info.blocks = 0;
+    }
+  }
+
   // Query error information from the device.
   bool get_errors(int &play_underruns, int &rec_overruns) {
     audio_errinfo error_info = {};
@@ -671,6 +775,9 @@ private:
   int _sample_rate = 48000;         // Sample rate.
   unsigned _fragments = 0;          // Number of OSS buffer fragments.
   unsigned _fragment_size = 0;      // OSS buffer fragment size.
+
+  FaultInjection *_faults = nullptr; // Fault injection, for testing.
+  std::uint64_t _ioctls = 0;         // Ioctls made during processing.
 };
 
 } // namespace sosso
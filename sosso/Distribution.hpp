@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_DISTRIBUTION_HPP
+#define SOSSO_DISTRIBUTION_HPP
+
+#include <bit>
+#include <cstdint>
+
+namespace sosso {
+
+/*!
+ * \brief Distribution of measured values.
+ *
+ * Records non-negative integer values like frames or nanoseconds in a fixed
+ * size histogram, to estimate quantiles of their distribution. Small values
+ * below 16 are recorded exactly, larger values in 8 buckets per power of two,
+ * which limits the quantile error to 12.5%. Quantiles are rounded up to the
+ * bucket bound, but never exceed the maximum value recorded.
+ * Recording a value is cheap and doesn't allocate, thus real-time safe.
+ */
+class Distribution {
+public:
+  //! Record a measured value, negative values count as zero.
+  void add(std::int64_t value) {
+    if (value < 0) {
+      value = 0;
+    }
+    _buckets[bucket(value)] += 1;
+    _count += 1;
+    if (value > _max) {
+      _max = value;
+    }
+  }
+
+  //! Clear all recorded values.
+  void clear() {
+    for (std::uint64_t &bucket : _buckets) {
+      bucket = 0;
+    }
+    _count = 0;
+    _max = 0;
+  }
+
+  //! Number of values recorded.
+  std::uint64_t count() const { return _count; }
+
+  //! Maximum value recorded, 0 if empty.
+  std::int64_t max() const { return _max; }
+
+  /*!
+   * \brief Estimate a quantile of the recorded values.
+   * \param q Quantile between 0 and 1, e.g. 0.999 for 99.9%.
+   * \return Upper bound of the quantile, maximum if not enough values.
+   */
+  std::int64_t quantile(double q) const {
+    if (_count == 0 || q >= 1.0) {
+      return _max;
+    }
+    // Values that are allowed to exceed the quantile.
+    double excess = (1.0 - q) * _count;
+    std::uint64_t below = 0;
+    for (unsigned i = 0; i < buckets; ++i) {
+      below += _buckets[i];
+      if (_count - below <= excess) {
+        std::int64_t bound = upper_bound(i);
+        return (bound < _max) ? bound : _max;
+      }
+    }
+    return _max;
+  }
+
+private:
+  // Exact buckets for small values, sub-buckets per power of two above.
+  static constexpr unsigned exact = 16;
+  static constexpr unsigned sub_buckets = 8;
+  static constexpr unsigned buckets = exact + (63 - 4) * sub_buckets;
+
+  // Bucket index of a non-negative value.
+  static unsigned bucket(std::int64_t value) {
+    if (value < exact) {
+      return value;
+    }
+    std::uint64_t v = value;
+    unsigned octave = std::bit_width(v) - 1;
+    unsigned sub = (v >> (octave - 3)) & (sub_buckets - 1);
+    return exact + (octave - 4) * sub_buckets + sub;
+  }
+
+  // Largest value that falls into a bucket.
+  static std::int64_t upper_bound(unsigned index) {
+    if (index < exact) {
+      return index;
+    }
+    unsigned octave = 4 + (index - exact) / sub_buckets;
+    std::uint64_t sub = (index - exact) % sub_buckets;
+    return static_cast<std::int64_t>(((sub_buckets + sub + 1) << (octave - 3)) -
+                                     1);
+  }
+
+  std::uint64_t _buckets[buckets] = {}; // Histogram buckets.
+  std::uint64_t _count = 0;             // Number of values recorded.
+  std::int64_t _max = 0;                // Maximum value recorded.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_DISTRIBUTION_HPP
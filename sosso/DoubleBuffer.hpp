@@ -19,6 +19,7 @@
 
 #include "sosso/Buffer.hpp"
 #include "sosso/Logging.hpp"
+#include "sosso/SegmentedBuffer.hpp"
 #include <algorithm>
 #include <limits>
 
@@ -36,8 +37,11 @@ namespace sosso {
  * replacement times, synchronized with channel progress.
  * The wakeup times for processing are adapted to available channel data and
  * work pending (unprocessed buffer data).
+ * Buffers are of type Buffer by default, use SegmentedBuffer as BufferType for
+ * buffer memory that is not contiguous.
  */
-template <class Channel> class DoubleBuffer : public Channel {
+template <class Channel, class BufferType = Buffer>
+class DoubleBuffer : public Channel {
   /*!
    * \brief Store a buffer and its end position.
    *
@@ -46,7 +50,7 @@ template <class Channel> class DoubleBuffer : public Channel {
    * channel data, independent of read and write positions.
    */
   struct BufferRecord {
-    Buffer buffer;               // External buffer, may be empty.
+    BufferType buffer;           // External buffer, may be empty.
     std::int64_t end_frames = 0; // Buffer end position in frames.
   };
 
@@ -60,7 +64,7 @@ public:
    * \param end_frames End position of the buffer in frames.
    * \return True if successful, false means there are already two buffers.
    */
-  bool set_buffer(Buffer &&buffer, std::int64_t end_frames) {
+  bool set_buffer(BufferType &&buffer, std::int64_t end_frames) {
     // Set secondary buffer if available.
     if (!_buffer_b.buffer.valid()) {
       _buffer_b.buffer = std::move(buffer);
@@ -82,7 +86,7 @@ public:
   bool reset_buffers(std::int64_t end_frames) {
     // Reset primary buffer.
     if (_buffer_a.buffer.valid()) {
-      std::memset(_buffer_a.buffer.data(), 0, _buffer_a.buffer.length());
+      _buffer_a.buffer.fill(Channel::silence());
       _buffer_a.buffer.reset();
       Log::info(SOSSO_LOC, "Primary buffer reset from %lld to %lld.",
                 _buffer_a.end_frames, end_frames);
@@ -90,7 +94,7 @@ public:
     }
     // Reset secondary buffer.
     if (_buffer_b.buffer.valid()) {
-      std::memset(_buffer_b.buffer.data(), 0, _buffer_b.buffer.length());
+      _buffer_b.buffer.fill(Channel::silence());
       _buffer_b.buffer.reset();
       end_frames += _buffer_b.buffer.length() / Channel::frame_size();
       Log::info(SOSSO_LOC, "Secondary buffer reset from %lld to %lld.",
@@ -100,8 +104,37 @@ public:
     return ready();
   }
 
+  /*!
+   * \brief Shift the buffer end positions, keep the buffer contents.
+   * \param offset Shift in frames, positive moves the buffers later.
+   * \return True if ready to proceed.
+   */
+  bool shift_buffers(std::int64_t offset) {
+    if (_buffer_a.buffer.valid()) {
+      _buffer_a.end_frames += offset;
+    }
+    if (_buffer_b.buffer.valid()) {
+      _buffer_b.end_frames += offset;
+    }
+    return ready();
+  }
+
+  /*!
+   * \brief Replace queued playback data of both buffers after an update.
+   *
+   * For buffer contents changed in place after they were written, e.g. a
+   * parameter change that should be audible early. See WriteChannel::rewrite().
+   * \return The number of frames rewritten.
+   */
+  template <class Playback = Channel>
+  std::int64_t rewrite_buffers() {
+    // Template for WriteChannel only, not instantiated with ReadChannel.
+    return Playback::rewrite(_buffer_a.buffer, _buffer_a.end_frames) +
+           Playback::rewrite(_buffer_b.buffer, _buffer_b.end_frames);
+  }
+
   //! Retrieve the primary buffer, may be empty.
-  Buffer &&take_buffer() {
+  BufferType &&take_buffer() {
     std::swap(_buffer_a, _buffer_b);
     return std::move(_buffer_b.buffer);
   }
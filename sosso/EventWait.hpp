@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_EVENTWAIT_HPP
+#define SOSSO_EVENTWAIT_HPP
+
+#include "sosso/FrameClock.hpp"
+#include "sosso/Logging.hpp"
+#include <cstdint>
+#include <initializer_list>
+#include <sys/errno.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+
+namespace sosso {
+
+/*!
+ * \brief Wait for a frame time deadline and other events.
+ *
+ * Instead of sleeping until the next wakeup time, the thread waits for either
+ * the wakeup time or events on other file descriptors, like control sockets,
+ * IPC clients or devices. Other threads can also wake it up through notify().
+ * All events that occurred are reported together, so they can be handled
+ * within the same wakeup.
+ * Implemented with kqueue on FreeBSD, and with epoll, timerfd and eventfd on
+ * Linux. Each file descriptor is registered with an id to identify its events.
+ */
+class EventWait {
+public:
+  //! Event id of the wakeup time deadline.
+  static constexpr int deadline_id = -1;
+
+  //! Event id of a notify() wakeup.
+  static constexpr int notify_id = -2;
+
+  //! Maximum number of events reported per wait.
+  static constexpr unsigned max_events = 16;
+
+  //! Always close before destruction.
+  ~EventWait() { close(); }
+
+  //! Indicate that the event wait is open.
+  bool is_open() const { return _queue >= 0; }
+
+  //! Open the event queue, with deadline timer and notification.
+  bool open() {
+    if (is_open()) {
+      return true;
+    }
+#if defined(__linux__)
+    _queue = epoll_create1(EPOLL_CLOEXEC);
+    _timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    _notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_queue >= 0 && _timer >= 0 && _notify >= 0 &&
+        add(_timer, deadline_id) && add(_notify, notify_id)) {
+      return true;
+    }
+#else
+    _queue = kqueue();
+    if (_queue >= 0) {
+      struct kevent change;
+      EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+             reinterpret_cast<void *>(static_cast<std::intptr_t>(notify_id)));
+      if (kevent(_queue, &change, 1, nullptr, 0, nullptr) == 0) {
+        return true;
+      }
+    }
+#endif
+    Log::warn(SOSSO_LOC, "Unable to open event queue, error %d.", errno);
+    close();
+    return false;
+  }
+
+  //! Close the event queue.
+  void close() {
+    for (int *fd : {&_queue, &_timer, &_notify}) {
+      if (*fd >= 0) {
+        ::close(*fd);
+        *fd = -1;
+      }
+    }
+    _events = 0;
+  }
+
+  /*!
+   * \brief Wait for events on a file descriptor.
+   * \param fd File descriptor, e.g. a socket or an OSS device.
+   * \param id Non-negative event id to identify the file descriptor.
+   * \param write Wait for write instead of read availability.
+   * \return True if successful.
+   */
+  bool add(int fd, int id, bool write = false) {
+#if defined(__linux__)
+    epoll_event event = {};
+    event.events = write ? EPOLLOUT : EPOLLIN;
+    event.data.u64 = static_cast<std::uint32_t>(id);
+    if (epoll_ctl(_queue, EPOLL_CTL_ADD, fd, &event) == 0) {
+      return true;
+    }
+#else
+    struct kevent change;
+    EV_SET(&change, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_ADD, 0, 0,
+           reinterpret_cast<void *>(static_cast<std::intptr_t>(id)));
+    if (kevent(_queue, &change, 1, nullptr, 0, nullptr) == 0) {
+      return true;
+    }
+#endif
+    Log::warn(SOSSO_LOC, "Unable to add event fd %d, error %d.", fd, errno);
+    return false;
+  }
+
+  /*!
+   * \brief Stop waiting for events on a file descriptor.
+   * \param fd File descriptor previously added.
+   * \param write Remove the write instead of the read event.
+   * \return True if successful.
+   */
+  bool remove(int fd, bool write = false) {
+#if defined(__linux__)
+    (void)write;
+    return epoll_ctl(_queue, EPOLL_CTL_DEL, fd, nullptr) == 0;
+#else
+    struct kevent change;
+    EV_SET(&change, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_DELETE, 0, 0,
+           nullptr);
+    return kevent(_queue, &change, 1, nullptr, 0, nullptr) == 0;
+#endif
+  }
+
+  //! Wake up the waiting thread, may be called from any thread.
+  bool notify() {
+#if defined(__linux__)
+    std::uint64_t count = 1;
+    return ::write(_notify, &count, sizeof(count)) == sizeof(count);
+#else
+    struct kevent change;
+    EV_SET(&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, nullptr);
+    return kevent(_queue, &change, 1, nullptr, 0, nullptr) == 0;
+#endif
+  }
+
+  /*!
+   * \brief Wait until wakeup time or other events, whatever comes first.
+   * \param clock Frame clock to determine the wakeup time.
+   * \param wakeup_frame Wakeup time in frames, see FrameClock.
+   * \return True if successful, see events() for what happened.
+   */
+  bool wait(const FrameClock &clock, std::int64_t wakeup_frame) {
+    _events = 0;
+    timespec deadline = clock.frames_to_monotonic(wakeup_frame);
+#if defined(__linux__)
+    itimerspec timer = {{0, 0}, deadline};
+    if (timerfd_settime(_timer, TFD_TIMER_ABSTIME, &timer, nullptr) != 0) {
+      Log::warn(SOSSO_LOC, "Set wakeup timer failed with error %d.", errno);
+      return false;
+    }
+    epoll_event events[max_events];
+    int count = -1;
+    do {
+      count = epoll_wait(_queue, events, max_events, -1);
+    } while (count < 0 && errno == EINTR);
+    for (int i = 0; i < count; ++i) {
+      int id = static_cast<std::int32_t>(events[i].data.u64);
+      if (id == deadline_id || id == notify_id) {
+        // Consume the timer expiration or notification counter.
+        std::uint64_t value = 0;
+        int fd = (id == deadline_id) ? _timer : _notify;
+        if (::read(fd, &value, sizeof(value)) != sizeof(value)) {
+          continue;
+        }
+      }
+      _ids[_events++] = id;
+    }
+#else
+    // Leave room for the deadline, it is not an event of the queue.
+    struct kevent events[max_events - 1];
+    int count = -1;
+    do {
+      timespec timeout = relative_timeout(deadline);
+      count = kevent(_queue, nullptr, 0, events, max_events - 1, &timeout);
+    } while (count < 0 && errno == EINTR);
+    for (int i = 0; i < count; ++i) {
+      std::intptr_t id = reinterpret_cast<std::intptr_t>(events[i].udata);
+      _ids[_events++] = static_cast<int>(id);
+    }
+    // Other events may come with or after the deadline, check it anyway.
+    if (count == 0 || (count > 0 && passed(deadline))) {
+      _ids[_events++] = deadline_id;
+    }
+#endif
+    if (count < 0) {
+      Log::warn(SOSSO_LOC, "Event wait failed with error %d.", errno);
+      return false;
+    }
+    return true;
+  }
+
+  //! Number of events that occurred during the last wait.
+  unsigned events() const { return _events; }
+
+  //! Event id of an event that occurred during the last wait.
+  int event(unsigned index) const {
+    return (index < _events) ? _ids[index] : deadline_id;
+  }
+
+  //! Indicate that the wakeup time was reached during the last wait.
+  bool deadline() const { return occurred(deadline_id); }
+
+  //! Indicate that a given event occurred during the last wait.
+  bool occurred(int id) const {
+    for (unsigned i = 0; i < _events; ++i) {
+      if (_ids[i] == id) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+#if !defined(__linux__)
+  // Relative timeout until an absolute monotonic deadline.
+  static timespec relative_timeout(const timespec &deadline) {
+    timespec now = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    std::int64_t ns = (deadline.tv_sec - now.tv_sec) * 1000000000 +
+                      deadline.tv_nsec - now.tv_nsec;
+    if (ns < 0) {
+      ns = 0;
+    }
+    timespec result = {static_cast<time_t>(ns / 1000000000),
+                       static_cast<long>(ns % 1000000000)};
+    return result;
+  }
+
+  // Indicate that an absolute monotonic deadline has passed.
+  static bool passed(const timespec &deadline) {
+    timespec left = relative_timeout(deadline);
+    return left.tv_sec == 0 && left.tv_nsec == 0;
+  }
+#endif
+
+  int _queue = -1;           // Event queue, epoll or kqueue.
+  int _timer = -1;           // Deadline timerfd, Linux only.
+  int _notify = -1;          // Notification eventfd, Linux only.
+  int _ids[max_events] = {}; // Event ids of the last wait.
+  unsigned _events = 0;      // Number of events of the last wait.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_EVENTWAIT_HPP
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_FAULTINJECTION_HPP
+#define SOSSO_FAULTINJECTION_HPP
+
+#include <cstdint>
+
+namespace sosso {
+
+/*!
+ * \brief Deterministic fault injection, with recovery measurement.
+ *
+ * Device and FrameClock ask for a fault at each opportunity of a fault class,
+ * like an I/O call or a pointer query. Each fault class is injected at a fixed
+ * interval of opportunities, which makes test runs reproducible. Only one
+ * fault is active at a time: After an injection, no further faults are
+ * injected until the channels have recovered, i.e. reached sync level 0.
+ * Recovery is measured per fault class, as frames lost, wakeups spent and
+ * time until recovery, see recovery(). Measurement starts at injection, from
+ * the time and loss of the wakeup the fault is injected in.
+ */
+class FaultInjection {
+public:
+  //! Fault classes.
+  enum Fault : unsigned {
+    again,        //!< I/O returns EAGAIN.
+    interrupt,    //!< I/O returns EINTR.
+    short_io,     //!< I/O transfers only half the requested length.
+    ioctl_error,  //!< Pointer or counter ioctl fails with EIO.
+    pointer_jump, //!< Pointer jumps ahead, magnitude in frames.
+    buffer_cycle, //!< Pointer reports a bogus extra buffer cycle.
+    stalled,      //!< Pointer doesn't progress.
+    late_wakeup,  //!< Wakeup is late, magnitude in frames.
+    faults        //!< Number of fault classes.
+  };
+
+  //! Recovery statistics of a fault class.
+  struct Recovery {
+    std::uint64_t injected = 0;   //!< Number of faults injected.
+    std::uint64_t recovered = 0;  //!< Number of completed recoveries.
+    std::int64_t frames_lost = 0; //!< Total frames lost.
+    std::uint64_t wakeups = 0;    //!< Total wakeups until recovered.
+    std::int64_t time = 0;        //!< Total recovery time in frames.
+    std::int64_t max_time = 0;    //!< Longest recovery time in frames.
+  };
+
+  //! Name of a fault class, for logging.
+  static const char *fault_name(unsigned fault) {
+    static const char *names[faults] = {
+        "EAGAIN",       "EINTR",        "short I/O", "ioctl error",
+        "pointer jump", "buffer cycle", "stalled",   "late wakeup"};
+    return (fault < faults) ? names[fault] : "unknown";
+  }
+
+  /*!
+   * \brief Configure injection of a fault class.
+   * \param fault Fault class.
+   * \param interval Inject at every n-th opportunity, 0 disables.
+   * \param magnitude Fault specific, e.g. frames of a pointer jump.
+   */
+  void set_fault(Fault fault, unsigned interval, std::int64_t magnitude = 0) {
+    _classes[fault].interval = interval;
+    _classes[fault].magnitude = magnitude;
+    _classes[fault].opportunities = 0;
+  }
+
+  //! Magnitude of a fault class, see set_fault().
+  std::int64_t magnitude(Fault fault) const {
+    return _classes[fault].magnitude;
+  }
+
+  /*!
+   * \brief Opportunity for a fault, called by the faulting component.
+   * \param fault Fault class.
+   * \return True if the fault is to be injected now.
+   */
+  bool inject(Fault fault) {
+    FaultClass &state = _classes[fault];
+    if (state.interval == 0) {
+      return false;
+    }
+    state.opportunities += 1;
+    if (_active < faults || state.opportunities < state.interval) {
+      return false;
+    }
+    state.opportunities = 0;
+    state.recovery.injected += 1;
+    _active = fault;
+    _start_time = _wakeup_time;
+    _start_loss = _wakeup_loss;
+    _wakeups = 0;
+    return true;
+  }
+
+  /*!
+   * \brief Track recovery from an injected fault, call on every wakeup.
+   *
+   * Injections until the next wakeup start their recovery from here.
+   * \param now Current frame time.
+   * \param total_loss Total frames lost of all channels.
+   * \param synced Indicate that all channels are at sync level 0.
+   */
+  void wakeup(std::int64_t now, std::int64_t total_loss, bool synced) {
+    _wakeup_time = now;
+    _wakeup_loss = total_loss;
+    if (_active >= faults) {
+      return;
+    }
+    _wakeups += 1;
+    if (synced) {
+      Recovery &recovery = _classes[_active].recovery;
+      std::int64_t time = now - _start_time;
+      recovery.recovered += 1;
+      recovery.frames_lost += total_loss - _start_loss;
+      recovery.wakeups += _wakeups;
+      recovery.time += time;
+      if (time > recovery.max_time) {
+        recovery.max_time = time;
+      }
+      _active = faults;
+    }
+  }
+
+  //! Recovery statistics of a fault class.
+  const Recovery &recovery(Fault fault) const {
+    return _classes[fault].recovery;
+  }
+
+private:
+  // Configuration and state of a fault class.
+  struct FaultClass {
+    unsigned interval = 0;      // Opportunities per injection.
+    std::int64_t magnitude = 0; // Fault specific magnitude.
+    unsigned opportunities = 0; // Opportunities since last injection.
+    Recovery recovery;          // Recovery statistics.
+  };
+
+  FaultClass _classes[faults];   // Fault classes.
+  unsigned _active = faults;     // Fault being recovered, faults if none.
+  std::int64_t _wakeup_time = 0; // Frame time of last wakeup.
+  std::int64_t _wakeup_loss = 0; // Total loss at last wakeup.
+  std::int64_t _start_time = 0;  // Frame time of recovery start.
+  std::int64_t _start_loss = 0;  // Total loss at recovery start.
+  std::uint64_t _wakeups = 0;    // Wakeups since recovery start.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_FAULTINJECTION_HPP
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_FLIGHTRECORDER_HPP
+#define SOSSO_FLIGHTRECORDER_HPP
+
+#include "sosso/Logging.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace sosso {
+
+/*!
+ * \brief Binary record of a scheduling event.
+ *
+ * Plain fixed size data, written as is to flight recorder dumps.
+ */
+struct FlightRecord {
+  std::int64_t time = 0;       //!< Frame time of the event.
+  std::int64_t value = 0;      //!< Event specific, e.g. progress step.
+  std::int64_t position = 0;   //!< Channel progress or buffer position.
+  std::int64_t balance = 0;    //!< Channel balance at the event.
+  std::int32_t sync_level = 0; //!< Channel sync level at the event.
+  std::uint16_t event = 0;     //!< Event type, see FlightRecorder.
+  std::uint16_t source = 0;    //!< Channel or other source of the event.
+};
+
+/*!
+ * \brief Header of a flight recorder dump file.
+ */
+struct FlightHeader {
+  char magic[4] = {'S', 'O', 'F', 'R'};             //!< File identification.
+  std::uint32_t version = 1;                        //!< File format version.
+  std::uint32_t record_size = sizeof(FlightRecord); //!< Size of a record.
+  std::uint32_t records = 0;                        //!< Records in file.
+  std::uint32_t sample_rate = 0;                    //!< Rate of frame times.
+  std::uint32_t trigger_event = 0;                  //!< Event that froze.
+  std::int64_t trigger_time = 0;                    //!< Time of trigger.
+};
+
+/*!
+ * \brief Always-on recorder of recent scheduling events.
+ *
+ * Keeps the most recent scheduling events like wakeups, pointer progress and
+ * buffer positions in a fixed size ring of binary records. Recording is cheap
+ * and doesn't allocate, thus real-time safe. On loss or a missed deadline, the
+ * recorder is triggered and freezes after a few more events, to capture the
+ * aftermath. A non-realtime thread then dumps the history to a file and
+ * resumes recording. Dumps are decoded by the flight_decode tool.
+ * Only one thread may record events, usually the realtime processing thread.
+ */
+class FlightRecorder {
+public:
+  //! Event types recorded.
+  enum Event : std::uint16_t {
+    wakeup = 1, //!< Wakeup from sleep, value is the planned wakeup time.
+    progress,   //!< Pointer progress detected, value is progress step.
+    loss,       //!< Loss detected, value is frames lost.
+    buffer,     //!< Buffer position, value is end of current period.
+    deadline,   //!< Deadline missed, value is frames late.
+    correction, //!< Drift correction applied, value is correction.
+  };
+
+  //! Name of an event type, for decoding.
+  static const char *event_name(unsigned event) {
+    switch (event) {
+    case wakeup:
+      return "wakeup";
+    case progress:
+      return "progress";
+    case loss:
+      return "loss";
+    case buffer:
+      return "buffer";
+    case deadline:
+      return "deadline";
+    case correction:
+      return "correction";
+    }
+    return "unknown";
+  }
+
+  /*!
+   * \brief Allocate the record ring, not real-time safe.
+   *
+   * Call once before recording, never while a dump may be in progress.
+   * \param records Number of recent records kept.
+   * \param sample_rate Sample rate of frame times, stored in dumps.
+   */
+  void init(unsigned records, unsigned sample_rate) {
+    _records.assign(records, FlightRecord());
+    _sample_rate = sample_rate;
+    _next = 0;
+    _post_trigger = 0;
+    _frozen.store(false, std::memory_order_release);
+  }
+
+  //! Indicate that the recorder is allocated and recording.
+  bool enabled() const { return !_records.empty(); }
+
+  //! Record an event, unless frozen.
+  void record(const FlightRecord &record) {
+    // Acquire orders the writes after a dump that ended with resume().
+    if (_records.empty() || _frozen.load(std::memory_order_acquire)) {
+      return;
+    }
+    _records[_next % _records.size()] = record;
+    _next += 1;
+    if (_post_trigger > 0 && --_post_trigger == 0) {
+      _frozen.store(true, std::memory_order_release);
+    }
+  }
+
+  /*!
+   * \brief Trigger a dump, freeze after some more events.
+   * \param record The triggering event, recorded as well.
+   */
+  void trigger(const FlightRecord &record) {
+    if (_records.empty() || _post_trigger > 0 ||
+        _frozen.load(std::memory_order_acquire)) {
+      this->record(record);
+      return;
+    }
+    _trigger = record;
+    // Keep recording for an eighth of the ring to capture the aftermath.
+    _post_trigger = _records.size() / 8 + 1;
+    this->record(record);
+  }
+
+  //! Indicate the recorder is frozen and ready to be dumped.
+  bool frozen() const { return _frozen.load(std::memory_order_acquire); }
+
+  /*!
+   * \brief Write the frozen history to a file, not real-time safe.
+   * \param path File path of the dump.
+   * \return True if successful, false means an error occurred.
+   */
+  bool dump(const char *path) const {
+    if (!frozen()) {
+      return false;
+    }
+    FlightHeader header;
+    std::uint64_t count = std::min<std::uint64_t>(_next, _records.size());
+    header.records = count;
+    header.sample_rate = _sample_rate;
+    header.trigger_event = _trigger.event;
+    header.trigger_time = _trigger.time;
+    std::FILE *file = std::fopen(path, "wb");
+    if (!file) {
+      Log::warn(SOSSO_LOC, "Unable to open %s, error %d.", path, errno);
+      return false;
+    }
+    bool success = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    // Records in chronological order, oldest first.
+    for (std::uint64_t i = _next - count; success && i < _next; ++i) {
+      const FlightRecord &record = _records[i % _records.size()];
+      success = std::fwrite(&record, sizeof(record), 1, file) == 1;
+    }
+    if (std::fclose(file) != 0 || !success) {
+      Log::warn(SOSSO_LOC, "Unable to write %s, error %d.", path, errno);
+      return false;
+    }
+    return true;
+  }
+
+  //! Resume recording after a dump, keep the recorded history.
+  void resume() { _frozen.store(false, std::memory_order_release); }
+
+private:
+  std::vector<FlightRecord> _records; // Ring of recent records.
+  std::uint64_t _next = 0;            // Total number of records written.
+  std::uint64_t _post_trigger = 0;    // Records left until frozen.
+  FlightRecord _trigger;              // Event that triggered the freeze.
+  unsigned _sample_rate = 0;          // Sample rate of frame times.
+  std::atomic<bool> _frozen = false;  // Recording stopped for dump.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_FLIGHTRECORDER_HPP
@@ -17,7 +17,10 @@
 #ifndef SOSSO_FRAMECLOCK_HPP
 #define SOSSO_FRAMECLOCK_HPP
 
+#include "sosso/Distribution.hpp"
+#include "sosso/FaultInjection.hpp"
 #include "sosso/Logging.hpp"
+#include <cmath>
 #include <sys/errno.h>
 #include <time.h>
 
@@ -30,6 +33,11 @@ namespace sosso {
  * device was started. Instead of nanoseconds it measures time in frames
  * (samples per channel), and thus needs to know the sample rate.
  * It also lets a thread sleep until a specified wakeup time, again in frames.
+ * The latency of these wakeups is measured, and can be compensated by going to
+ * sleep early, according to a quantile of the measured wakeup latency.
+ * Optionally the clock rate follows the progress of a master channel, through
+ * a software PLL on the master's balance. Frame time then runs in the time
+ * base of the master device, and other channels are corrected relative to it.
  */
 class FrameClock {
 public:
@@ -39,6 +47,9 @@ public:
    * \return True if successful, false means an error occurred.
    */
   bool init_clock(unsigned sample_rate) {
+    stop_following();
+    _anchor_ns = 0;
+    _anchor_frames = 0;
     return set_sample_rate(sample_rate) && init_zero_time();
   }
 
@@ -50,7 +61,7 @@ public:
   bool now(std::int64_t &result) const {
     std::int64_t time_ns = 0;
     if (get_time_offset(time_ns)) {
-      result = time_to_frames(time_ns);
+      result = offset_to_frames(time_ns);
       return true;
     }
     return false;
@@ -61,9 +72,87 @@ public:
    * \param wakeup_frame Wakeup time in frames since time zero.
    * \return True if successful, false means an error occurred.
    */
-  bool sleep(std::int64_t wakeup_frame) const {
-    std::int64_t time_ns = frames_to_time(wakeup_frame);
-    return sleep_until(time_ns);
+  bool sleep(std::int64_t wakeup_frame) {
+    if (_faults && _faults->inject(FaultInjection::late_wakeup)) {
+      wakeup_frame += _faults->magnitude(FaultInjection::late_wakeup);
+    }
+    // Go to sleep early to compensate wakeup latency.
+    std::int64_t time_ns = frames_to_offset(wakeup_frame) - _compensation;
+    std::int64_t before_ns = 0;
+    if (!get_time_offset(before_ns) || !sleep_until(time_ns)) {
+      return false;
+    }
+    std::int64_t after_ns = 0;
+    if (before_ns < time_ns && get_time_offset(after_ns)) {
+      learn_latency(after_ns - time_ns);
+    }
+    return true;
+  }
+
+  /*!
+   * \brief Inject late wakeups into sleep(), for testing.
+   * \param faults Fault injection, nullptr to disable.
+   */
+  void set_fault_injection(FaultInjection *faults) { _faults = faults; }
+
+  /*!
+   * \brief Set the wakeup latency compensation for sleep().
+   * \param quantile Quantile of measured wakeup latency, 0 to disable.
+   */
+  void set_wakeup_compensation(double quantile) {
+    _compensation_quantile = quantile;
+    if (quantile <= 0) {
+      _compensation = 0;
+    }
+  }
+
+  //! Current wakeup latency compensation, in nanoseconds.
+  std::int64_t wakeup_compensation() const { return _compensation; }
+
+  //! Measured wakeup latency of sleep(), in nanoseconds.
+  const Distribution &wakeup_latency() const { return _wakeup_latency; }
+
+  /*!
+   * \brief Let the thread wait precisely until wakeup time.
+   *
+   * Sleeps until shortly before the wakeup time, then spins on the clock for
+   * the final stretch. This avoids wakeup latency at the expense of CPU time.
+   * \param wakeup_frame Wakeup time in frames since time zero.
+   * \param spin_frames Length of the final stretch to spin, in frames.
+   * \return True if successful, false means an error occurred.
+   */
+  bool wait(std::int64_t wakeup_frame, std::int64_t spin_frames) const {
+    std::int64_t time_ns = frames_to_offset(wakeup_frame);
+    if (!sleep_until(time_ns - frames_to_time(spin_frames))) {
+      return false;
+    }
+    std::int64_t now_ns = 0;
+    do {
+      if (!get_time_offset(now_ns)) {
+        return false;
+      }
+    } while (now_ns < time_ns);
+    return true;
+  }
+
+  /*!
+   * \brief Convert a CLOCK_MONOTONIC time to frame time.
+   * \param time Absolute monotonic time, e.g. from clock_gettime().
+   * \return Frame time as offset from time zero.
+   */
+  std::int64_t monotonic_to_frames(const timespec &time) const {
+    std::int64_t time_ns = ((time.tv_sec - _zero.tv_sec) * 1000000000) +
+                           time.tv_nsec - _zero.tv_nsec;
+    return offset_to_frames(time_ns);
+  }
+
+  /*!
+   * \brief Convert frame time to an absolute CLOCK_MONOTONIC time.
+   * \param frame Frame time as offset from time zero.
+   * \return Absolute monotonic time, e.g. for timers.
+   */
+  timespec frames_to_monotonic(std::int64_t frame) const {
+    return absolute_time(frames_to_offset(frame));
   }
 
   //! Convert frames to time in nanoseconds.
@@ -79,9 +168,62 @@ public:
   //! Convert frames to system clock time in microseconds.
   std::int64_t frames_to_absolute_us(std::int64_t frames) const {
     return _zero.tv_sec * 1000000ULL + _zero.tv_nsec / 1000 +
-           frames_to_time(frames) / 1000;
+           frames_to_offset(frames) / 1000;
   }
 
+  /*!
+   * \brief Adjust the clock rate to follow the progress of a master channel.
+   *
+   * Call this regularly, e.g. once per period, with the balance of the master
+   * channel. The balance deviation from the first call is fed to a second
+   * order PLL, which adjusts the clock rate within +-1000ppm. Frame time stays
+   * continuous when the rate changes.
+   * \param balance Current balance of the master channel, in frames.
+   * \param interval Frames elapsed since the last call, e.g. period length.
+   * \return True if successful, false means an error occurred.
+   */
+  bool follow(std::int64_t balance, std::int64_t interval) {
+    // Re-anchor frame time at current time, keep it continuous.
+    std::int64_t now_ns = 0;
+    if (interval <= 0 || !get_time_offset(now_ns)) {
+      return false;
+    }
+    _anchor_frames = offset_to_frames(now_ns);
+    _anchor_ns = now_ns;
+    if (!_following) {
+      _following = true;
+      _follow_origin = balance;
+      _rate_integral = 0;
+    }
+    // Loop bandwidth per interval, critically damped PI controller.
+    double error = balance - _follow_origin;
+    double omega = double(interval) / (_sample_rate * follow_seconds);
+    _rate_integral += error * omega * omega / interval;
+    double adjust = _rate_integral + error * 1.4 * omega / interval;
+    adjust = std::fmax(-follow_limit, std::fmin(adjust, follow_limit));
+    // Master behind frame time (positive balance) means slow down.
+    _rate_ratio = 1.0 - adjust;
+    return true;
+  }
+
+  //! Stop following a master channel, return to nominal clock rate.
+  void stop_following() {
+    std::int64_t now_ns = 0;
+    if (_following && get_time_offset(now_ns)) {
+      _anchor_frames = offset_to_frames(now_ns);
+      _anchor_ns = now_ns;
+    }
+    _following = false;
+    _rate_ratio = 1.0;
+    _rate_integral = 0;
+  }
+
+  //! Indicate that the clock rate follows a master channel.
+  bool following() const { return _following; }
+
+  //! Current clock rate relative to nominal sample rate.
+  double rate_ratio() const { return _rate_ratio; }
+
   //! Currently used sample rate in Hz.
   unsigned sample_rate() const { return _sample_rate; }
 
@@ -98,6 +240,41 @@ public:
   unsigned stepping() const { return 16U * (1U + (_sample_rate / 50000)); }
 
 private:
+  // Time constant of the PLL in seconds, and rate adjustment limit.
+  static constexpr double follow_seconds = 8.0;
+  static constexpr double follow_limit = 0.001;
+
+  // Frame time of an offset from time zero, at current clock rate.
+  std::int64_t offset_to_frames(std::int64_t offset_ns) const {
+    std::int64_t frames = time_to_frames(offset_ns - _anchor_ns);
+    if (_rate_ratio != 1.0) {
+      frames += std::llround(frames * (_rate_ratio - 1.0));
+    }
+    return _anchor_frames + frames;
+  }
+
+  // Offset from time zero of a frame time, at current clock rate.
+  std::int64_t frames_to_offset(std::int64_t frame) const {
+    std::int64_t time_ns = frames_to_time(frame - _anchor_frames);
+    if (_rate_ratio != 1.0) {
+      time_ns -= std::llround(time_ns * (1.0 - 1.0 / _rate_ratio));
+    }
+    return _anchor_ns + time_ns;
+  }
+
+  // Record wakeup latency and update compensation periodically.
+  void learn_latency(std::int64_t latency_ns) {
+    _wakeup_latency.add(latency_ns);
+    if (_compensation_quantile > 0 && _wakeup_latency.count() % 64 == 0) {
+      // Wake up early by at most one wakeup step.
+      std::int64_t limit = frames_to_time(stepping());
+      _compensation = _wakeup_latency.quantile(_compensation_quantile);
+      if (_compensation > limit) {
+        _compensation = limit;
+      }
+    }
+  }
+
   // Initialize time zero now.
   bool init_zero_time() { return gettime(_zero); }
 
@@ -112,10 +289,22 @@ private:
     return false;
   }
 
+  // Absolute monotonic time of an offset from time zero, in nanoseconds.
+  timespec absolute_time(std::int64_t offset_ns) const {
+    timespec result = {
+        _zero.tv_sec + (_zero.tv_nsec + offset_ns) / 1000000000,
+        (_zero.tv_nsec + offset_ns) % 1000000000};
+    if (result.tv_nsec < 0) {
+      // Negative offset, normalize to positive nanoseconds.
+      result.tv_sec -= 1;
+      result.tv_nsec += 1000000000;
+    }
+    return result;
+  }
+
   // Let thread sleep until wakeup time, in nanoseconds since time zero.
   bool sleep_until(std::int64_t offset_ns) const {
-    timespec wakeup = {_zero.tv_sec + (_zero.tv_nsec + offset_ns) / 1000000000,
-                       (_zero.tv_nsec + offset_ns) % 1000000000};
+    timespec wakeup = absolute_time(offset_ns);
     if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) != 0) {
       Log::warn(SOSSO_LOC, "Sleep failed with error %d.", errno);
       return false;
@@ -132,8 +321,18 @@ private:
     return true;
   }
 
-  timespec _zero = {0, 0};       // Time zero as a timespec struct.
-  unsigned _sample_rate = 48000; // Sample rate used for frame conversion.
+  timespec _zero = {0, 0};           // Time zero as a timespec struct.
+  unsigned _sample_rate = 48000;     // Sample rate used for frame conversion.
+  Distribution _wakeup_latency;      // Measured wakeup latency in ns.
+  double _compensation_quantile = 0; // Latency quantile to compensate.
+  std::int64_t _compensation = 0;    // Wakeup latency compensation in ns.
+  std::int64_t _anchor_ns = 0;       // Time offset of rate change anchor.
+  std::int64_t _anchor_frames = 0;   // Frame time of rate change anchor.
+  double _rate_ratio = 1.0;          // Clock rate relative to nominal.
+  double _rate_integral = 0;         // Integral part of PLL rate adjustment.
+  std::int64_t _follow_origin = 0;   // Master balance when following began.
+  bool _following = false;           // Clock rate follows a master channel.
+  FaultInjection *_faults = nullptr; // Fault injection, for testing.
 };
 
 } // namespace sosso
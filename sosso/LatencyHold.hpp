@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_LATENCYHOLD_HPP
+#define SOSSO_LATENCYHOLD_HPP
+
+#include "sosso/Logging.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/errno.h>
+#include <unistd.h>
+
+namespace sosso {
+
+/*!
+ * \brief Hold a CPU power management latency limit while streaming.
+ *
+ * Deep CPU idle states add considerable latency to wakeups from sleep. While
+ * channels are running, a latency limit keeps the CPU out of idle states that
+ * take longer to resume. On Linux this is a PM QoS request, either global
+ * through /dev/cpu_dma_latency, or for a single CPU through its resume latency
+ * limit in sysfs. The global request is released automatically when closed,
+ * the per CPU limit is restored to its previous value.
+ * Other systems have no equivalent per process request, holding a latency
+ * limit does nothing there.
+ */
+class LatencyHold {
+public:
+  //! Always release before destruction.
+  ~LatencyHold() { release(); }
+
+  //! Indicate that a latency limit is currently held.
+  bool holding() const { return _fd >= 0 || _cpu >= 0; }
+
+  /*!
+   * \brief Hold a global CPU wakeup latency limit.
+   * \param latency_us Maximum wakeup latency in microseconds.
+   * \return True if successful, false means the limit is not in effect.
+   */
+  bool hold(std::int32_t latency_us) {
+#if defined(__linux__)
+    release();
+    _fd = ::open("/dev/cpu_dma_latency", O_WRONLY | O_CLOEXEC);
+    if (_fd >= 0 && ::write(_fd, &latency_us, sizeof(latency_us)) ==
+                        static_cast<ssize_t>(sizeof(latency_us))) {
+      Log::info(SOSSO_LOC, "Hold CPU latency limit of %d us.", latency_us);
+      return true;
+    }
+    Log::warn(SOSSO_LOC, "Unable to hold CPU latency limit, error %d.", errno);
+    release();
+#else
+    (void)latency_us;
+#endif
+    return false;
+  }
+
+  /*!
+   * \brief Hold a resume latency limit for a single CPU.
+   * \param cpu Index of the CPU the processing thread runs on.
+   * \param latency_us Maximum resume latency in microseconds.
+   * \return True if successful, false means the limit is not in effect.
+   */
+  bool hold_cpu(int cpu, std::int32_t latency_us) {
+#if defined(__linux__)
+    release();
+    char previous[32] = {};
+    if (access_limit(cpu, previous, sizeof(previous), false)) {
+      char limit[32];
+      std::snprintf(limit, sizeof(limit), "%d", latency_us);
+      if (access_limit(cpu, limit, sizeof(limit), true)) {
+        _cpu = cpu;
+        std::snprintf(_previous, sizeof(_previous), "%s", previous);
+        Log::info(SOSSO_LOC, "Hold CPU %d latency limit of %d us.", cpu,
+                  latency_us);
+        return true;
+      }
+    }
+    Log::warn(SOSSO_LOC, "Unable to hold CPU %d latency limit, error %d.", cpu,
+              errno);
+#else
+    (void)cpu;
+    (void)latency_us;
+#endif
+    return false;
+  }
+
+  //! Release the latency limit, e.g. when channels are idle.
+  void release() {
+    if (_fd >= 0) {
+      ::close(_fd);
+      _fd = -1;
+    }
+    if (_cpu >= 0) {
+      access_limit(_cpu, _previous, sizeof(_previous), true);
+      _cpu = -1;
+    }
+  }
+
+private:
+  // Read or write the resume latency limit of a CPU in sysfs.
+  static bool access_limit(int cpu, char *value, std::size_t size,
+                           bool write) {
+    char path[96];
+    std::snprintf(path, sizeof(path),
+                  "/sys/devices/system/cpu/cpu%d/power/"
+                  "pm_qos_resume_latency_us",
+                  cpu);
+    int fd = ::open(path, (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    ssize_t result = 0;
+    if (write) {
+      std::size_t length = 0;
+      while (length < size && value[length] != '\0' && value[length] != '\n') {
+        ++length;
+      }
+      result = ::write(fd, value, length);
+    } else {
+      result = ::read(fd, value, size - 1);
+      if (result >= 0) {
+        value[result] = '\0';
+      }
+    }
+    ::close(fd);
+    return result > 0;
+  }
+
+  int _fd = -1;            // Global PM QoS request, closed to release.
+  int _cpu = -1;           // CPU with resume latency limit, -1 if none.
+  char _previous[32] = {}; // Previous resume latency limit of the CPU.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_LATENCYHOLD_HPP
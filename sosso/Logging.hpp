@@ -17,8 +17,10 @@
 #ifndef SOSSO_LOGGING_HPP
 #define SOSSO_LOGGING_HPP
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <time.h>
 
 namespace sosso {
 
@@ -63,6 +65,16 @@ struct SourceLocation {
  *
  * For printf-style message composition use the corresponding variable argument
  * function templates, limited to 255 character length.
+ *
+ * To avoid log storms during recovery, formatted info() and warn() messages
+ * are rate limited per call site. Beyond a burst of messages per interval,
+ * further messages are not even formatted, only counted with cheap atomic
+ * operations. The application should call flush_suppressed() regularly from a
+ * non-realtime thread, which reports the suppressed messages as "repeated N
+ * times" summaries at their original log level, with the call site location
+ * and the last message shown. Call sites are keyed by source file and line.
+ * Low-level log() messages are not rate limited, the application decides
+ * whether to output them at all.
  */
 class Log {
 public:
@@ -83,8 +95,13 @@ public:
   //! Compose printf-style user information messages.
   template <typename... Args>
   static void info(SourceLocation location, const char *message, Args... args) {
+    Site *call_site = site(location, false);
+    if (suppress(call_site)) {
+      return;
+    }
     char formatted[256];
     std::snprintf(formatted, 256, message, args...);
+    remember(call_site, formatted);
     info(location, formatted);
   }
 
@@ -94,10 +111,141 @@ public:
   //! Compose printf-style warning messages.
   template <typename... Args>
   static void warn(SourceLocation location, const char *message, Args... args) {
+    Site *call_site = site(location, true);
+    if (suppress(call_site)) {
+      return;
+    }
     char formatted[256];
     std::snprintf(formatted, 256, message, args...);
+    remember(call_site, formatted);
     warn(location, formatted);
   }
+
+  /*!
+   * \brief Set the rate limit for formatted messages, per call site.
+   * \param burst Messages per interval before suppression, 0 for no limit.
+   * \param interval_ms Length of the interval in milliseconds.
+   */
+  static void set_rate_limit(unsigned burst, unsigned interval_ms) {
+    _burst.store(burst, std::memory_order_relaxed);
+    _interval_ns.store(interval_ms * 1000000LL, std::memory_order_relaxed);
+  }
+
+  //! Report suppressed messages, call regularly from a non-realtime thread.
+  static void flush_suppressed() {
+    for (unsigned i = 0; i < max_sites; ++i) {
+      Site &site = sites()[i];
+      if (!site.ready.load(std::memory_order_acquire)) {
+        continue;
+      }
+      std::uint64_t repeated =
+          site.suppressed.exchange(0, std::memory_order_relaxed);
+      if (repeated > 0) {
+        char formatted[256];
+        // Wait for a concurrent remember() to complete, it is short.
+        while (site.busy.exchange(true, std::memory_order_acquire)) {
+        }
+        std::snprintf(formatted, 256, "Repeated %llu times, last: %.200s",
+                      static_cast<unsigned long long>(repeated), site.last);
+        site.busy.store(false, std::memory_order_release);
+        // Reported at the call site location, which the application shows.
+        if (site.warning) {
+          warn(site.location, formatted);
+        } else {
+          info(site.location, formatted);
+        }
+      }
+    }
+  }
+
+private:
+  // Rate limiting state of a call site, identified by file and line.
+  struct Site {
+    std::atomic<std::uint64_t> key = 0;           // Location key, see key().
+    std::atomic<bool> ready = false;              // Location stored.
+    SourceLocation location = {0, 0, "", ""};     // Location of call site.
+    bool warning = false;                         // Call site logs warnings.
+    std::atomic<bool> busy = false;               // Last message in use.
+    char last[256] = {};                          // Last message shown.
+    std::atomic<std::int64_t> interval_start = 0; // Begin of interval, in ns.
+    std::atomic<unsigned> emitted = 0;            // Messages in interval.
+    std::atomic<std::uint64_t> suppressed = 0;    // Messages suppressed.
+  };
+
+  // Number of call sites tracked, more are not rate limited.
+  static constexpr unsigned max_sites = 256;
+
+  // Rate limited call sites, constant initialized.
+  static Site *sites() {
+    static Site call_sites[max_sites];
+    return call_sites;
+  }
+
+  // Site key of a source location, file name pointer and line packed.
+  static std::uint64_t key(const SourceLocation &location) {
+    return (reinterpret_cast<std::uintptr_t>(location.file_name()) << 16) ^
+           location.line();
+  }
+
+  // Find or register the call site of a source location, if rate limited.
+  static Site *site(const SourceLocation &location, bool warning) {
+    if (_burst.load(std::memory_order_relaxed) == 0) {
+      return nullptr;
+    }
+    std::uint64_t site_key = key(location);
+    std::uint64_t hash = site_key ^ (site_key >> 19);
+    for (unsigned probe = 0; probe < 16; ++probe) {
+      Site &site = sites()[(hash + probe) % max_sites];
+      std::uint64_t current = site.key.load(std::memory_order_acquire);
+      if (current == 0 &&
+          site.key.compare_exchange_strong(current, site_key,
+                                           std::memory_order_acq_rel)) {
+        // Claimed a free slot, publish location for flush_suppressed().
+        site.location = location;
+        site.warning = warning;
+        site.ready.store(true, std::memory_order_release);
+        return &site;
+      }
+      if (current == site_key) {
+        return &site;
+      }
+    }
+    return nullptr;
+  }
+
+  // Count the message and decide whether it exceeds the rate limit.
+  static bool suppress(Site *call_site) {
+    timespec time = {0, 0};
+    if (!call_site || clock_gettime(CLOCK_MONOTONIC, &time) != 0) {
+      return false;
+    }
+    std::int64_t now = time.tv_sec * 1000000000LL + time.tv_nsec;
+    std::int64_t start =
+        call_site->interval_start.load(std::memory_order_relaxed);
+    if (now - start >= _interval_ns.load(std::memory_order_relaxed) &&
+        call_site->interval_start.compare_exchange_strong(
+            start, now, std::memory_order_relaxed)) {
+      call_site->emitted.store(0, std::memory_order_relaxed);
+    }
+    unsigned burst = _burst.load(std::memory_order_relaxed);
+    if (call_site->emitted.fetch_add(1, std::memory_order_relaxed) < burst) {
+      return false;
+    }
+    call_site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Keep the message shown for the summary, skipped while flushing.
+  static void remember(Site *call_site, const char *formatted) {
+    if (call_site &&
+        !call_site->busy.exchange(true, std::memory_order_acquire)) {
+      std::snprintf(call_site->last, sizeof(call_site->last), "%s", formatted);
+      call_site->busy.store(false, std::memory_order_release);
+    }
+  }
+
+  static inline std::atomic<unsigned> _burst = 10; // Messages per interval.
+  static inline std::atomic<std::int64_t> _interval_ns = 1000000000; // 1s.
 };
 
 } // namespace sosso
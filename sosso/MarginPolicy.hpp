@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_MARGINPOLICY_HPP
+#define SOSSO_MARGINPOLICY_HPP
+
+#include "sosso/Distribution.hpp"
+#include <cstdint>
+
+namespace sosso {
+
+/*!
+ * \brief Safety margins from measured distributions.
+ *
+ * Derives safety margins for wakeup planning from a target probability of
+ * over- and underruns per hour. Each wakeup is a chance to miss the deadline,
+ * so the target probability is divided by the number of wakeups per hour. The
+ * resulting quantile is taken from the distributions of progress steps, wakeup
+ * lateness and processing duration.
+ * Without enough measurements for the quantile, the margin falls back to the
+ * worst case observed. A target probability of 0 always uses the worst case.
+ */
+class MarginPolicy {
+public:
+  /*!
+   * \brief Set the accepted probability of over- and underruns.
+   * \param per_hour Probability per hour, 0 means worst case margins.
+   */
+  void set_xrun_probability(double per_hour) { _per_hour = per_hour; }
+
+  //! Accepted probability of over- and underruns per hour.
+  double xrun_probability() const { return _per_hour; }
+
+  //! Indicate that margins are based on quantiles instead of worst case.
+  bool enabled() const { return _per_hour > 0; }
+
+  /*!
+   * \brief Calculate the quantile to be used for margins.
+   * \param wakeups_per_hour Expected number of wakeups per hour.
+   * \return Quantile between 0 and 1, 1 for worst case margins.
+   */
+  double quantile(double wakeups_per_hour) const {
+    if (!enabled() || wakeups_per_hour <= 0) {
+      return 1.0;
+    }
+    double per_wakeup = _per_hour / wakeups_per_hour;
+    return (per_wakeup < 1.0) ? 1.0 - per_wakeup : 0.0;
+  }
+
+  /*!
+   * \brief Calculate a margin from a measured distribution.
+   * \param distribution Measured distribution, e.g. wakeup lateness.
+   * \param wakeups_per_hour Expected number of wakeups per hour.
+   * \return Margin in the unit of the distribution.
+   */
+  std::int64_t margin(const Distribution &distribution,
+                      double wakeups_per_hour) const {
+    return distribution.quantile(quantile(wakeups_per_hour));
+  }
+
+private:
+  double _per_hour = 0; // Accepted probability of over- and underruns.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_MARGINPOLICY_HPP
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_PERIODPOOL_HPP
+#define SOSSO_PERIODPOOL_HPP
+
+#include "sosso/Buffer.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace sosso {
+
+/*!
+ * \brief Read access to a published period.
+ *
+ * Holds one reference to a period buffer of a PeriodPool, read-only. The
+ * reference is released on destruction or release(), after which the period
+ * buffer may be recycled. Like Buffer, it can only be moved, not copied.
+ */
+class SharedPeriod {
+public:
+  //! Construct an empty and invalid SharedPeriod.
+  SharedPeriod() = default;
+
+  /*!
+   * \brief Move construct a period reference.
+   * \param other Adopt the reference from this SharedPeriod, leaving it empty.
+   */
+  SharedPeriod(SharedPeriod &&other) noexcept { adopt(other); }
+
+  /*!
+   * \brief Move assign a period reference, release the current one.
+   * \param other Adopt the reference from this SharedPeriod, leaving it empty.
+   * \return This newly assigned SharedPeriod.
+   */
+  SharedPeriod &operator=(SharedPeriod &&other) {
+    if (this != &other) {
+      release();
+      adopt(other);
+    }
+    return *this;
+  }
+
+  //! Release the reference on destruction.
+  ~SharedPeriod() { release(); }
+
+  //! Valid if it references a published period.
+  bool valid() const { return _references != nullptr; }
+
+  //! Read-only access to the period data, null if invalid.
+  const char *data() const { return _data; }
+
+  //! Length of the period data in bytes, 0 if invalid.
+  std::size_t length() const { return _length; }
+
+  //! End position of the period in frames, as used for DoubleBuffer.
+  std::int64_t end_frames() const { return _end_frames; }
+
+  //! Publishing sequence number of the period.
+  std::uint64_t sequence() const { return _sequence; }
+
+  //! Release the reference, the period buffer may be recycled afterwards.
+  void release() {
+    if (_references) {
+      _references->fetch_sub(1, std::memory_order_acq_rel);
+    }
+    _references = nullptr;
+    _data = nullptr;
+    _length = 0;
+    _end_frames = 0;
+    _sequence = 0;
+  }
+
+private:
+  friend class PeriodPool;
+
+  // Reference a published period, constructed by PeriodPool.
+  SharedPeriod(std::atomic<unsigned> *references, const char *data,
+               std::size_t length, std::int64_t end_frames,
+               std::uint64_t sequence)
+      : _references(references), _data(data), _length(length),
+        _end_frames(end_frames), _sequence(sequence) {}
+
+  // Take over the reference of another SharedPeriod, leaving it empty.
+  void adopt(SharedPeriod &other) {
+    _references = other._references;
+    _data = other._data;
+    _length = other._length;
+    _end_frames = other._end_frames;
+    _sequence = other._sequence;
+    other._references = nullptr;
+    other._data = nullptr;
+    other._length = 0;
+    other._end_frames = 0;
+    other._sequence = 0;
+  }
+
+  std::atomic<unsigned> *_references = nullptr; // Reference count of period.
+  const char *_data = nullptr;                  // Period data, read-only.
+  std::size_t _length = 0;                      // Length of period data.
+  std::int64_t _end_frames = 0;                 // Period end position.
+  std::uint64_t _sequence = 0;                  // Publishing sequence number.
+};
+
+/*!
+ * \brief Pool of reference counted period buffers.
+ *
+ * Distributes captured periods to a fixed number of readers without copying
+ * them. The real-time thread acquires a free period buffer from the pool,
+ * fills it (e.g. through DoubleBuffer<ReadChannel>), and publishes it. Then
+ * each reader fetches the published periods in sequence and gets read-only
+ * access through a SharedPeriod. Once all readers released a period, its
+ * buffer is recycled to the pool.
+ * Acquire and publish are meant for a single producer thread, fetch() can be
+ * called concurrently by the readers. No locks or allocations are involved
+ * after init(). Every reader has to fetch and release every published period,
+ * in order, otherwise the pool runs dry and acquire() fails.
+ */
+class PeriodPool {
+  // Period buffer record, buffer memory is stored separately.
+  struct Slot {
+    std::atomic<unsigned> references{0};    // Readers yet to release.
+    std::atomic<std::uint64_t> sequence{0}; // Publishing sequence number.
+    std::int64_t end_frames = 0;            // Period end position in frames.
+    std::size_t length = 0;                 // Length of period data.
+  };
+
+public:
+  /*!
+   * \brief Allocate period buffers, not real-time safe.
+   * \param periods Number of period buffers in the pool.
+   * \param period_size Size of one period buffer in bytes.
+   * \param readers Number of readers that fetch each period.
+   * \return True if successful.
+   */
+  bool init(unsigned periods, std::size_t period_size, unsigned readers) {
+    if (periods == 0 || period_size == 0 || readers == 0) {
+      return false;
+    }
+    _memory.assign(periods * period_size, '\0');
+    _slots = std::make_unique<Slot[]>(periods);
+    _sequenced = std::make_unique<SlotIndex[]>(periods);
+    _periods = periods;
+    _period_size = period_size;
+    _readers = readers;
+    _next = 0;
+    _dropped = 0;
+    _published.store(0, std::memory_order_release);
+    return true;
+  }
+
+  //! Number of period buffers in the pool.
+  unsigned periods() const { return _periods; }
+
+  //! Number of readers that fetch each period.
+  unsigned readers() const { return _readers; }
+
+  //! Number of periods published so far, also the next sequence number.
+  std::uint64_t published() const {
+    return _published.load(std::memory_order_acquire);
+  }
+
+  //! Number of failed acquire() attempts because all buffers were in use.
+  std::uint64_t dropped() const { return _dropped; }
+
+  /*!
+   * \brief Acquire a free period buffer, producer thread only.
+   * \return Buffer to be filled and published, invalid if none available.
+   */
+  Buffer acquire() {
+    for (unsigned i = 0; i < _periods; ++i) {
+      unsigned slot = (_next + i) % _periods;
+      if (_slots[slot].references.load(std::memory_order_acquire) == 0) {
+        // Reserve for the readers, not visible to them until published.
+        _slots[slot].references.store(_readers, std::memory_order_relaxed);
+        _next = slot + 1;
+        return Buffer(_memory.data() + slot * _period_size, _period_size);
+      }
+    }
+    _dropped += 1;
+    return Buffer();
+  }
+
+  /*!
+   * \brief Publish a filled period buffer to the readers, producer thread only.
+   * \param buffer Buffer obtained from acquire(), left empty.
+   * \param end_frames End position of the period in frames.
+   * \return True if successful, false if the buffer is not from this pool.
+   */
+  bool publish(Buffer &&buffer, std::int64_t end_frames) {
+    Buffer period = std::move(buffer);
+    unsigned slot = 0;
+    if (!find_slot(period, slot)) {
+      return false;
+    }
+    std::uint64_t sequence = _published.load(std::memory_order_relaxed);
+    _slots[slot].sequence.store(sequence, std::memory_order_relaxed);
+    _slots[slot].end_frames = end_frames;
+    _slots[slot].length = period.length();
+    _sequenced[sequence % _periods].store(slot, std::memory_order_release);
+    _published.store(sequence + 1, std::memory_order_release);
+    return true;
+  }
+
+  /*!
+   * \brief Return an acquired but unpublished buffer to the pool.
+   * \param buffer Buffer obtained from acquire(), left empty.
+   */
+  void discard(Buffer &&buffer) {
+    Buffer period = std::move(buffer);
+    unsigned slot = 0;
+    if (find_slot(period, slot)) {
+      _slots[slot].references.store(0, std::memory_order_release);
+    }
+  }
+
+  /*!
+   * \brief Fetch a published period, for each reader in sequence.
+   * \param sequence Sequence number of the period, see published().
+   * \return Reference to the period, invalid if not published yet.
+   */
+  SharedPeriod fetch(std::uint64_t sequence) {
+    if (sequence < published()) {
+      unsigned slot =
+          _sequenced[sequence % _periods].load(std::memory_order_acquire);
+      Slot &record = _slots[slot];
+      if (record.sequence.load(std::memory_order_relaxed) == sequence) {
+        return SharedPeriod(&record.references,
+                            _memory.data() + slot * _period_size,
+                            record.length, record.end_frames, sequence);
+      }
+    }
+    return SharedPeriod();
+  }
+
+private:
+  // Find the slot of a buffer from acquire().
+  bool find_slot(const Buffer &buffer, unsigned &slot) const {
+    if (buffer.valid() && buffer.data() >= _memory.data() &&
+        buffer.data() < _memory.data() + _memory.size()) {
+      slot = (buffer.data() - _memory.data()) / _period_size;
+      return true;
+    }
+    return false;
+  }
+
+  using SlotIndex = std::atomic<unsigned>;
+
+  std::vector<char> _memory;                // Memory of all period buffers.
+  std::unique_ptr<Slot[]> _slots;           // Period buffer records.
+  std::unique_ptr<SlotIndex[]> _sequenced;  // Published slots by sequence.
+  std::atomic<std::uint64_t> _published{0}; // Number of published periods.
+  unsigned _periods = 0;                    // Number of period buffers.
+  std::size_t _period_size = 0;             // Period buffer size in bytes.
+  unsigned _readers = 0;                    // Number of readers.
+  unsigned _next = 0;                       // Next slot to try on acquire.
+  std::uint64_t _dropped = 0;               // Failed acquire attempts.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_PERIODPOOL_HPP
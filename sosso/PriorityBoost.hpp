@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_PRIORITYBOOST_HPP
+#define SOSSO_PRIORITYBOOST_HPP
+
+#include "sosso/Logging.hpp"
+#include <cstdint>
+#include <pthread.h>
+#include <sched.h>
+
+namespace sosso {
+
+/*!
+ * \brief Raise thread priority only when audio processing runs short of time.
+ *
+ * Monitors the slack of the processing thread, which is the headroom before
+ * the estimated OSS buffer dropout. When slack falls below a low threshold,
+ * the thread is switched to a boosted scheduling policy and priority. It drops
+ * back to normal scheduling once slack stays above a high threshold for a
+ * number of cycles. This hysteresis avoids frequent scheduling changes, which
+ * are system calls. Other threads get the CPU while audio is comfortable.
+ * The normal scheduling is read from the thread before each boost, and
+ * restored when dropping back. If the boost is not permitted, e.g. lack of
+ * privileges, boosting is disabled after a warning.
+ */
+class PriorityBoost {
+public:
+  /*!
+   * \brief Set the boosted scheduling of the thread.
+   * \param policy Scheduling policy, e.g. SCHED_FIFO or SCHED_RR.
+   * \param priority Scheduling priority within the policy.
+   */
+  void set_boost(int policy, int priority) {
+    _boost_policy = policy;
+    _boost_priority = priority;
+  }
+
+  /*!
+   * \brief Set the slack thresholds for boost, 0 disables boosting.
+   * \param low Boost when slack falls below, in frames.
+   * \param high Drop back when slack is above, in frames.
+   * \param cycles Number of cycles slack has to stay above high threshold.
+   */
+  void set_thresholds(std::int64_t low, std::int64_t high,
+                      unsigned cycles = 16) {
+    _low = low;
+    _high = (high > low) ? high : low;
+    _cycles = cycles;
+  }
+
+  //! Indicate that boosting is configured and permitted.
+  bool enabled() const { return _low > 0 && !_denied; }
+
+  //! Indicate that the thread currently runs boosted.
+  bool boosted() const { return _boosted; }
+
+  //! Number of boosts since start.
+  std::uint64_t boosts() const { return _boosts; }
+
+  /*!
+   * \brief Update the thread scheduling from current slack, once per cycle.
+   * \param slack Current slack of the processing thread, in frames.
+   * \return True if successful, false means scheduling change failed.
+   */
+  bool update(std::int64_t slack) {
+    if (!enabled()) {
+      return true;
+    }
+    if (!_boosted && slack < _low) {
+      _comfortable = 0;
+      if (!apply(true)) {
+        return false;
+      }
+      _boosts += 1;
+      return true;
+    }
+    if (_boosted) {
+      _comfortable = (slack > _high) ? _comfortable + 1 : 0;
+      if (_comfortable >= _cycles) {
+        return apply(false);
+      }
+    }
+    return true;
+  }
+
+  //! Return to normal scheduling, e.g. at the end of processing.
+  bool reset() {
+    _comfortable = 0;
+    return !_boosted || apply(false);
+  }
+
+private:
+  // Change the scheduling of the current thread.
+  bool apply(bool boost) {
+    int error = 0;
+    sched_param param = {};
+    int policy = _boost_policy;
+    if (boost) {
+      // Remember the current scheduling to drop back to.
+      error = pthread_getschedparam(pthread_self(), &_normal_policy,
+                                    &_normal_param);
+      param.sched_priority = _boost_priority;
+    } else {
+      param = _normal_param;
+      policy = _normal_policy;
+    }
+    if (error == 0) {
+      error = pthread_setschedparam(pthread_self(), policy, &param);
+    }
+    if (error != 0) {
+      Log::warn(SOSSO_LOC, "Priority boost failed with error %d, disabled.",
+                error);
+      _denied = true;
+      return false;
+    }
+    _boosted = boost;
+    return true;
+  }
+
+  int _normal_policy = SCHED_OTHER; // Normal scheduling policy.
+  sched_param _normal_param = {};   // Normal scheduling parameters.
+  int _boost_policy = SCHED_FIFO;   // Boosted scheduling policy.
+  int _boost_priority = 80;         // Boosted scheduling priority.
+  std::int64_t _low = 0;            // Slack threshold for boost.
+  std::int64_t _high = 0;           // Slack threshold to drop back.
+  unsigned _cycles = 16;            // Cycles above high threshold to drop.
+  unsigned _comfortable = 0;        // Cycles above high threshold so far.
+  std::uint64_t _boosts = 0;        // Number of boosts.
+  bool _boosted = false;            // Thread currently boosted.
+  bool _denied = false;             // Boost not permitted.
+};
+
+/*!
+ * \brief Return to normal scheduling when this object goes out of scope.
+ *
+ * Keeps a boost from outliving the processing loop on early returns.
+ */
+class PriorityBoostScope {
+public:
+  //! Drop back to normal scheduling of the boost at the end of the scope.
+  explicit PriorityBoostScope(PriorityBoost &boost) : _boost(boost) {}
+
+  //! Return to normal scheduling.
+  ~PriorityBoostScope() { _boost.reset(); }
+
+  PriorityBoostScope(const PriorityBoostScope &other) = delete;
+  PriorityBoostScope &operator=(const PriorityBoostScope &other) = delete;
+
+private:
+  PriorityBoost &_boost; // Boost to reset.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_PRIORITYBOOST_HPP
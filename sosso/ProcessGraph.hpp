@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_PROCESSGRAPH_HPP
+#define SOSSO_PROCESSGRAPH_HPP
+
+#include "sosso/Logging.hpp"
+#include "sosso/RealtimeCheck.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+namespace sosso {
+
+/*!
+ * \brief Parallel execution of a processing graph, once per period.
+ *
+ * Processing nodes sit between capture and playback, connected by their data
+ * dependencies. On reconfiguration, prepare() orders the nodes topologically
+ * and starts worker threads. Then run() executes the graph once per period:
+ * Nodes without pending dependencies are queued, and independent branches are
+ * executed in parallel by the workers and the calling thread. The per period
+ * cost is thus set by the critical path rather than the number of nodes.
+ * run() returns when all nodes are complete, e.g. before the playback buffer
+ * is handed to DoubleBuffer<WriteChannel>::set_buffer().
+ * Dependency counters and the ready queue are lock-free, idle workers wait on
+ * a semaphore. Nodes are executed in a RealtimeScope, they have to be real-time
+ * safe. Adding nodes and connections is only allowed while not prepared.
+ * With a time budget given to run(), nodes that are ready after the budget is
+ * spent are skipped. An overrunning node still delays its successors within
+ * the period, but not beyond that: A node that takes longer than its own
+ * budget is skipped in the next period, with or without a run() budget.
+ * Skipped nodes call their bypass instead, to silence or repeat their outputs,
+ * so dependent nodes can proceed. Skips and overruns are counted per node.
+ */
+class ProcessGraph {
+  // Processing node and its dependencies.
+  struct Node {
+    std::function<void()> process;    // Node processing.
+    std::function<void()> bypass;     // Replaces processing when skipped.
+    std::vector<unsigned> successors; // Nodes depending on this one.
+    unsigned inputs = 0;              // Number of dependencies.
+    std::int64_t budget_ns = 0;       // Time budget, 0 for run() budget.
+  };
+
+  // Execution state of a node, shared by worker threads.
+  struct NodeState {
+    std::atomic<unsigned> pending{0};       // Dependencies left.
+    std::atomic<bool> penalty{false};       // Skip in the next period.
+    std::atomic<std::uint64_t> skips{0};    // Number of periods skipped.
+    std::atomic<std::uint64_t> overruns{0}; // Number of budget overruns.
+  };
+
+public:
+  //! Always stop worker threads before destruction.
+  ~ProcessGraph() { stop(); }
+
+  /*!
+   * \brief Add a processing node, not real-time safe.
+   * \param process Processing of the node, called once per period.
+   * \param bypass Called instead when skipped, e.g. to silence the outputs.
+   * \return Index of the new node.
+   */
+  unsigned add_node(std::function<void()> process,
+                    std::function<void()> bypass = {}) {
+    stop();
+    _nodes.push_back(Node{std::move(process), std::move(bypass), {}, 0, 0});
+    return _nodes.size() - 1;
+  }
+
+  /*!
+   * \brief Set the time budget of a node, not real-time safe.
+   * \param node Node index.
+   * \param budget_ns Processing time budget in ns, 0 for the run() budget.
+   * \return True if successful, false means invalid node index.
+   */
+  bool set_budget(unsigned node, std::int64_t budget_ns) {
+    if (node >= _nodes.size()) {
+      return false;
+    }
+    stop();
+    _nodes[node].budget_ns = budget_ns;
+    return true;
+  }
+
+  /*!
+   * \brief Add a data dependency between nodes, not real-time safe.
+   * \param from Node that has to complete first.
+   * \param to Node that depends on the output of from.
+   * \return True if successful, false means invalid node index.
+   */
+  bool connect(unsigned from, unsigned to) {
+    if (from >= _nodes.size() || to >= _nodes.size() || from == to) {
+      return false;
+    }
+    stop();
+    _nodes[from].successors.push_back(to);
+    _nodes[to].inputs += 1;
+    return true;
+  }
+
+  /*!
+   * \brief Set the scheduling of worker threads, see prepare().
+   * \param policy Scheduling policy, e.g. SCHED_FIFO like the caller of run().
+   * \param priority Scheduling priority within the policy.
+   */
+  void set_worker_scheduling(int policy, int priority) {
+    _worker_policy = policy;
+    _worker_priority = priority;
+  }
+
+  /*!
+   * \brief Order the nodes and start worker threads, not real-time safe.
+   * \param workers Number of worker threads, in addition to the run() caller.
+   * \return True if successful, false means the graph has a cycle.
+   */
+  bool prepare(unsigned workers) {
+    stop();
+    if (!sort()) {
+      Log::warn(SOSSO_LOC, "Processing graph has a cycle.");
+      return false;
+    }
+    std::size_t nodes = _nodes.size();
+    _states = std::make_unique<NodeState[]>(nodes);
+    _ready = std::make_unique<std::atomic<std::uint64_t>[]>(nodes);
+    _head.store(0, std::memory_order_relaxed);
+    _tail.store(0, std::memory_order_relaxed);
+    for (unsigned i = 0; i < workers; ++i) {
+      _workers.emplace_back([this](std::stop_token stop) { work(stop); });
+    }
+    _prepared = true;
+    Log::info(SOSSO_LOC, "Processing graph of %lu nodes, critical path %u.",
+              nodes, _critical_path);
+    return true;
+  }
+
+  //! Indicate that the graph is prepared to run.
+  bool prepared() const { return _prepared; }
+
+  //! Number of nodes in the graph.
+  unsigned nodes() const { return _nodes.size(); }
+
+  //! Number of nodes on the longest dependency chain, see prepare().
+  unsigned critical_path() const { return _critical_path; }
+
+  //! Nodes in topological order, see prepare().
+  const std::vector<unsigned> &order() const { return _order; }
+
+  //! Number of periods a node was skipped since prepare().
+  std::uint64_t skips(unsigned node) const {
+    if (!_prepared || node >= _nodes.size()) {
+      return 0;
+    }
+    return _states[node].skips.load(std::memory_order_relaxed);
+  }
+
+  //! Number of times a node overran its budget since prepare().
+  std::uint64_t overruns(unsigned node) const {
+    if (!_prepared || node >= _nodes.size()) {
+      return 0;
+    }
+    return _states[node].overruns.load(std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Execute all nodes once, from the processing thread.
+   * \param budget_ns Time budget of this period in ns, 0 for no deadline.
+   * \return True if successful, false means the graph is not prepared.
+   */
+  bool run(std::int64_t budget_ns = 0) {
+    if (!_prepared) {
+      return false;
+    }
+    if (_nodes.empty()) {
+      return true;
+    }
+    for (unsigned node = 0; node < _nodes.size(); ++node) {
+      _states[node].pending.store(_nodes[node].inputs,
+                                  std::memory_order_relaxed);
+    }
+    _budget = budget_ns;
+    _deadline = (budget_ns > 0) ? now_ns() + budget_ns : 0;
+    _remaining.store(_nodes.size(), std::memory_order_relaxed);
+    for (unsigned node : _order) {
+      if (_nodes[node].inputs == 0) {
+        push(node);
+      }
+    }
+    // Help with ready nodes, then wait for the workers to complete the rest.
+    unsigned node = 0;
+    while (pop(node)) {
+      execute(node);
+    }
+    _done.acquire();
+    return true;
+  }
+
+  //! Stop the worker threads, graph has to be prepared again to run.
+  void stop() {
+    for (std::jthread &worker : _workers) {
+      worker.request_stop();
+    }
+    _wakeup.release(_workers.size());
+    _workers.clear();
+    _prepared = false;
+  }
+
+private:
+  // Topological order by Kahn's algorithm, with longest dependency chain.
+  bool sort() {
+    std::vector<unsigned> inputs(_nodes.size());
+    std::vector<unsigned> depth(_nodes.size(), 1);
+    _order.clear();
+    for (unsigned node = 0; node < _nodes.size(); ++node) {
+      inputs[node] = _nodes[node].inputs;
+      if (inputs[node] == 0) {
+        _order.push_back(node);
+      }
+    }
+    _critical_path = 0;
+    for (std::size_t i = 0; i < _order.size(); ++i) {
+      unsigned node = _order[i];
+      if (depth[node] > _critical_path) {
+        _critical_path = depth[node];
+      }
+      for (unsigned successor : _nodes[node].successors) {
+        if (depth[successor] < depth[node] + 1) {
+          depth[successor] = depth[node] + 1;
+        }
+        if (--inputs[successor] == 0) {
+          _order.push_back(successor);
+        }
+      }
+    }
+    return _order.size() == _nodes.size();
+  }
+
+  // Queue a ready node and wake up a worker. The entry is published in its
+  // slot before the tail advances past it, so pop() never waits for a push()
+  // in flight. A push() preempted in between is helped along by the next one.
+  void push(unsigned node) {
+    std::uint64_t nodes = _nodes.size();
+    std::uint64_t position = _tail.load(std::memory_order_acquire);
+    while (true) {
+      std::atomic<std::uint64_t> &slot = _ready[position % nodes];
+      std::uint64_t entry = slot.load(std::memory_order_acquire);
+      // Tag the entry with its position, to tell it from previous runs.
+      if (entry / nodes <= position &&
+          slot.compare_exchange_weak(entry, (position + 1) * nodes + node,
+                                     std::memory_order_release,
+                                     std::memory_order_acquire)) {
+        break;
+      }
+      if (entry / nodes > position) {
+        // Slot already published by another push(), advance the tail for it.
+        std::uint64_t expected = position;
+        _tail.compare_exchange_strong(expected, position + 1,
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed);
+      }
+      position = _tail.load(std::memory_order_acquire);
+    }
+    std::uint64_t expected = position;
+    _tail.compare_exchange_strong(expected, position + 1,
+                                  std::memory_order_release,
+                                  std::memory_order_relaxed);
+    if (!_workers.empty()) {
+      _wakeup.release();
+    }
+  }
+
+  // Take a ready node from the queue, false if empty.
+  bool pop(unsigned &node) {
+    std::uint64_t position = _head.load(std::memory_order_relaxed);
+    do {
+      if (position >= _tail.load(std::memory_order_acquire)) {
+        return false;
+      }
+    } while (!_head.compare_exchange_weak(position, position + 1,
+                                          std::memory_order_relaxed));
+    // Entries below the tail are always published, see push().
+    std::uint64_t nodes = _nodes.size();
+    node = _ready[position % nodes].load(std::memory_order_acquire) % nodes;
+    return true;
+  }
+
+  // Current CLOCK_MONOTONIC time in nanoseconds.
+  static std::int64_t now_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return std::int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+  }
+
+  // Process a node within its budget, then release its successors.
+  void execute(unsigned node) {
+    const Node &record = _nodes[node];
+    NodeState &state = _states[node];
+    std::int64_t budget = (record.budget_ns > 0) ? record.budget_ns : _budget;
+    std::int64_t begin = (budget > 0) ? now_ns() : 0;
+    bool penalty = state.penalty.exchange(false, std::memory_order_relaxed);
+    if (penalty || (_deadline > 0 && begin > _deadline)) {
+      // Skip the node, let the bypass provide its outputs.
+      state.skips.fetch_add(1, std::memory_order_relaxed);
+      if (record.bypass) {
+        RealtimeScope realtime;
+        record.bypass();
+      }
+    } else {
+      {
+        RealtimeScope realtime;
+        record.process();
+      }
+      if (budget > 0 && now_ns() - begin > budget) {
+        state.overruns.fetch_add(1, std::memory_order_relaxed);
+        state.penalty.store(true, std::memory_order_relaxed);
+      }
+    }
+    for (unsigned successor : record.successors) {
+      std::atomic<unsigned> &pending = _states[successor].pending;
+      if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        push(successor);
+      }
+    }
+    if (_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      _done.release();
+    }
+  }
+
+  // Worker thread, executes ready nodes when woken up.
+  void work(std::stop_token stop) {
+    sched_param param = {};
+    param.sched_priority = _worker_priority;
+    int error = pthread_setschedparam(pthread_self(), _worker_policy, &param);
+    if (error != 0) {
+      Log::warn(SOSSO_LOC, "Worker scheduling failed with error %d.", error);
+    }
+    while (true) {
+      _wakeup.acquire();
+      if (stop.stop_requested()) {
+        return;
+      }
+      unsigned node = 0;
+      while (pop(node)) {
+        execute(node);
+      }
+    }
+  }
+
+  std::vector<Node> _nodes;         // Processing nodes.
+  std::vector<unsigned> _order;     // Nodes in topological order.
+  unsigned _critical_path = 0;      // Nodes on the longest dependency chain.
+  bool _prepared = false;           // Ordered and workers running.
+  int _worker_policy = SCHED_OTHER; // Worker scheduling policy.
+  int _worker_priority = 0;         // Worker scheduling priority.
+
+  std::unique_ptr<NodeState[]> _states;                 // Node states.
+  std::unique_ptr<std::atomic<std::uint64_t>[]> _ready; // Ready queue ring.
+  std::atomic<std::uint64_t> _head{0};                  // Ready queue head.
+  std::atomic<std::uint64_t> _tail{0};                  // Ready queue tail.
+  std::atomic<unsigned> _remaining{0};                  // Nodes left to run.
+  std::counting_semaphore<> _wakeup{0};                 // Wake up workers.
+  std::binary_semaphore _done{0};                       // All nodes done.
+  std::vector<std::jthread> _workers;                   // Worker threads.
+  std::int64_t _budget = 0;                             // Budget of run().
+  std::int64_t _deadline = 0;                           // End of run budget.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_PROCESSGRAPH_HPP
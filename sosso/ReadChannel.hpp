@@ -20,6 +20,7 @@
 #include "sosso/Buffer.hpp"
 #include "sosso/Channel.hpp"
 #include "sosso/Logging.hpp"
+#include <algorithm>
 #include <fcntl.h>
 
 namespace sosso {
@@ -31,6 +32,8 @@ namespace sosso {
  * track of the OSS recording progress, and reads the available audio data to an
  * external buffer. If the OSS buffer is memory mapped, the audio data is copied
  * from there. Otherwise I/O read() system calls are used.
+ * The external buffer is either a Buffer or a SegmentedBuffer, any other type
+ * providing the same interface will do.
  */
 class ReadChannel : public Channel {
 public:
@@ -45,6 +48,10 @@ public:
     if (exclusive) {
       mode |= O_EXCL;
     }
+    // Sample counter mode and position are per device, start over.
+    _sample_counter = true;
+    _oss_progress = 0;
+    _extra_latency = 0;
     return Channel::open(device, mode);
   }
 
@@ -68,6 +75,15 @@ public:
     return Channel::wakeup_time(sync_frames, oss_available());
   }
 
+  /*!
+   * \brief Headroom until the OSS buffer is estimated to overrun.
+   * \param now Current time in frame time, see FrameClock.
+   * \return Slack in frames, negative if the dropout is overdue.
+   */
+  std::int64_t slack(std::int64_t now) const {
+    return estimated_dropout(oss_available()) - now;
+  }
+
   /*!
    * \brief Check OSS progress and read recorded audio to the buffer.
    * \param buffer Buffer to write to, untouched if invalid.
@@ -75,12 +91,15 @@ public:
    * \param now Current time in frame time, see FrameClock.
    * \return True if successful, false means there was an error.
    */
-  bool process(Buffer &buffer, std::int64_t end, std::int64_t now) {
+  template <class BufferType>
+  bool process(BufferType &buffer, std::int64_t end, std::int64_t now) {
     if (map()) {
       return (progress_done(now) || check_map_progress(now)) &&
+             update_latency(buffer) &&
              (buffer_done(buffer, end) || process_mapped(buffer, end, now));
     } else {
       return (progress_done(now) || check_read_progress(now)) &&
+             update_latency(buffer) &&
              (buffer_done(buffer, end) || process_read(buffer, end, now));
     }
   }
@@ -96,7 +115,7 @@ protected:
       std::int64_t progress = map_progress() - _oss_progress;
       _oss_progress += progress;
       std::int64_t available = last_progress() + progress - _read_position;
-      std::int64_t loss = mark_loss(available - buffer_frames());
+      std::int64_t loss = account_loss(available - buffer_frames(), now);
       mark_progress(progress, now);
       if (loss > 0) {
         Log::warn(SOSSO_LOC, "OSS recording buffer overrun, %lld lost.", loss);
@@ -107,7 +126,8 @@ protected:
   }
 
   // Read recorded audio data to buffer, in case of memory mapped OSS buffer.
-  bool process_mapped(Buffer &buffer, std::int64_t end, std::int64_t now) {
+  template <class BufferType>
+  bool process_mapped(BufferType &buffer, std::int64_t end, std::int64_t now) {
     // Calculate current read buffer position.
     std::int64_t position = buffer_position(buffer, end);
     // Only read what is available until OSS captured its complete buffer.
@@ -134,8 +154,7 @@ protected:
       std::int64_t offset = last_progress() - position;
       std::size_t length = buffer.remaining(offset * frame_size());
       unsigned pointer = (_oss_progress - offset) % buffer_frames();
-      length = read_map(buffer.position(), pointer * frame_size(), length);
-      buffer.advance(length);
+      read_map_buffer(buffer, pointer * frame_size(), length);
       _read_position = buffer_position(buffer, end);
     }
     _read_position += freewheel_finish(buffer, end, now);
@@ -144,6 +163,10 @@ protected:
 
   // Check progress when using I/O read() system call.
   bool check_read_progress(std::int64_t now) {
+    if (_sample_counter && check_counter_progress(now)) {
+      return progress_done(now);
+    }
+    std::int64_t previous = last_progress();
     // Check for OSS buffer overruns.
     std::int64_t overdue = now - estimated_dropout(oss_available());
     if ((overdue > 0 && get_rec_overruns() > 0) || overdue > max_progress()) {
@@ -159,11 +182,40 @@ protected:
       mark_progress(progress, now);
       _read_position = last_progress() - queued;
     }
+    // Keep the counter position in sync, progress is not to be counted twice.
+    _oss_progress += last_progress() - previous;
     return progress_done(now);
   }
 
+  // Exact progress and loss from the absolute OSS sample counter, if provided.
+  bool check_counter_progress(std::int64_t now) {
+    std::int64_t samples = 0;
+    std::int64_t queued = 0;
+    if (!get_sample_count(samples, queued)) {
+      return false;
+    }
+    std::int64_t unread = last_progress() - _read_position;
+    std::int64_t progress = samples - _oss_progress;
+    if (progress < queued - unread) {
+      // Counter lags behind the OSS queue, driver doesn't provide it.
+      Log::info(SOSSO_LOC, "OSS sample counter not usable, use queue.");
+      _sample_counter = false;
+      return false;
+    }
+    _oss_progress = samples;
+    // Frames that were recorded but neither read nor queued are lost.
+    std::int64_t loss = account_loss(unread + progress - queued, now);
+    mark_progress(progress, now);
+    if (loss > 0) {
+      Log::warn(SOSSO_LOC, "OSS recording buffer overrun, %lld lost.", loss);
+    }
+    _read_position = last_progress() - queued;
+    return true;
+  }
+
   // Read recorded audio data to buffer, using I/O read() syscall.
-  bool process_read(Buffer &buffer, std::int64_t end, std::int64_t now) {
+  template <class BufferType>
+  bool process_read(BufferType &buffer, std::int64_t end, std::int64_t now) {
     bool ok = true;
     std::int64_t position = buffer_position(buffer, end);
     if (std::int64_t skip = buffer_advance(buffer, _read_position - position)) {
@@ -185,7 +237,9 @@ protected:
       std::int64_t gap = position - _read_position;
       std::size_t read_limit = buffer.remaining(gap * frame_size());
       std::size_t bytes_read = 0;
-      ok = read_io(buffer.position(), read_limit, bytes_read);
+      ok = read_io_buffer(buffer, read_limit, bytes_read);
+      // Drained data is overwritten by the next read, keep buffer position.
+      buffer.rewind(bytes_read);
       Log::info(SOSSO_LOC, "@%lld - %lld Read buffer gap %lld, drain %lu.", now,
                 end, gap, bytes_read / frame_size());
       _read_position += bytes_read / frame_size();
@@ -193,9 +247,8 @@ protected:
       // Read as much as current progress allows.
       std::size_t length = buffer.remaining(oss_available() * frame_size());
       std::size_t bytes_read = 0;
-      ok = read_io(buffer.position(), length, bytes_read);
+      ok = read_io_buffer(buffer, length, bytes_read);
       _read_position += bytes_read / frame_size();
-      buffer.advance(bytes_read);
     }
     freewheel_finish(buffer, end, now);
     return ok;
@@ -203,25 +256,39 @@ protected:
 
 private:
   // Calculate read position of the remaining buffer.
-  std::int64_t buffer_position(const Buffer &buffer, std::int64_t end) const {
+  template <class BufferType>
+  std::int64_t buffer_position(const BufferType &buffer,
+                               std::int64_t end) const {
     return end - extra_latency() - (buffer.remaining() / frame_size());
   }
 
   // Indicate that a buffer doesn't need further processing.
-  bool buffer_done(const Buffer &buffer, std::int64_t end) const {
+  template <class BufferType>
+  bool buffer_done(const BufferType &buffer, std::int64_t end) const {
     return buffer.done() && buffer_position(buffer, end) <= _read_position;
   }
 
   // Extra latency to always finish on time, regardless of OSS progress steps.
-  std::int64_t extra_latency() const { return max_progress(); }
+  std::int64_t extra_latency() const { return _extra_latency; }
+
+  // Follow the decaying maximum progress step. Widen immediately, but narrow
+  // only before a buffer is started, the read position must not jump back.
+  template <class BufferType>
+  bool update_latency(const BufferType &buffer) {
+    if (buffer.progress() == 0 || max_progress() > _extra_latency) {
+      _extra_latency = max_progress();
+    }
+    return true;
+  }
 
   // Avoid stalled buffers with irregular OSS progress in freewheel mode.
-  std::int64_t freewheel_finish(Buffer &buffer, std::int64_t end,
+  template <class BufferType>
+  std::int64_t freewheel_finish(BufferType &buffer, std::int64_t end,
                                 std::int64_t now) {
     std::int64_t advance = 0;
     if (freewheel() && now >= end + balance() && !buffer.done()) {
       // Buffer is overdue in freewheel sync mode, finish immediately.
-      std::memset(buffer.position(), 0, buffer.remaining());
+      buffer.clear(buffer.remaining(), silence());
       advance = buffer.advance(buffer.remaining()) / frame_size();
       Log::info(SOSSO_LOC, "@%lld - %lld Read buffer overdue, fill by %lu.",
                 now, end, advance);
@@ -230,25 +297,63 @@ private:
   }
 
   // Skip reading part of the buffer to match OSS read position.
-  std::int64_t buffer_advance(Buffer &buffer, std::int64_t frames) {
+  template <class BufferType>
+  std::int64_t buffer_advance(BufferType &buffer, std::int64_t frames) {
     if (frames > 0) {
-      std::size_t skip = buffer.remaining(frames * frame_size());
-      std::memset(buffer.position(), 0, skip);
+      std::size_t skip = buffer.clear(frames * frame_size(), silence());
       return buffer.advance(skip) / frame_size();
     }
     return 0;
   }
 
   // Rewind part of the buffer to match OSS read position.
-  std::int64_t buffer_rewind(Buffer &buffer, std::int64_t frames) {
+  template <class BufferType>
+  std::int64_t buffer_rewind(BufferType &buffer, std::int64_t frames) {
     if (frames > 0) {
       return buffer.rewind(frames * frame_size()) / frame_size();
     }
     return 0;
   }
 
-  std::int64_t _oss_progress = 0;  // Last memory mapped OSS progress.
+  // Read from memory mapped OSS buffer and advance, segment by segment.
+  template <class BufferType>
+  std::size_t read_map_buffer(BufferType &buffer, std::size_t offset,
+                              std::size_t length) {
+    std::size_t bytes_read = 0;
+    while (bytes_read < length && !buffer.done()) {
+      std::size_t chunk = std::min(length - bytes_read, buffer.contiguous());
+      chunk = read_map(buffer.position(), offset + bytes_read, chunk);
+      if (chunk == 0) {
+        break;
+      }
+      bytes_read += buffer.advance(chunk);
+    }
+    return bytes_read;
+  }
+
+  // Read through I/O read() syscall and advance, segment by segment.
+  template <class BufferType>
+  bool read_io_buffer(BufferType &buffer, std::size_t length,
+                      std::size_t &count) {
+    bool ok = true;
+    while (ok && length > 0 && !buffer.done()) {
+      std::size_t chunk = std::min(length, buffer.contiguous());
+      std::size_t bytes_read = 0;
+      ok = read_io(buffer.position(), chunk, bytes_read);
+      count += buffer.advance(bytes_read);
+      length -= bytes_read;
+      if (bytes_read < chunk) {
+        // Nothing more to read for now.
+        break;
+      }
+    }
+    return ok;
+  }
+
+  std::int64_t _oss_progress = 0;  // Last memory mapped or counted progress.
   std::int64_t _read_position = 0; // Current read position of channel.
+  std::int64_t _extra_latency = 0; // Recording latency, in frames.
+  bool _sample_counter = true;     // Use absolute OSS sample counter.
 };
 
 } // namespace sosso
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_REALTIMECHECK_HPP
+#define SOSSO_REALTIMECHECK_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <execinfo.h>
+#include <unistd.h>
+
+namespace sosso {
+
+/*!
+ * \brief Detect real-time safety violations.
+ *
+ * Code paths that have to be real-time safe are marked with a RealtimeScope.
+ * Within such a scope, memory allocation and mutex locks are reported as
+ * violations, with a call stack on stderr. The detection itself is opt-in:
+ * RealtimeCheck.cpp interposes the allocation and locking functions and has
+ * to be linked into the application, see BUILD_REALTIME_CHECK. Without it,
+ * the scopes only maintain a thread local counter.
+ * Reporting avoids allocation, so it is safe to call from the interposed
+ * functions themselves.
+ */
+class RealtimeCheck {
+public:
+  //! Indicate that the current thread is in a real-time scope.
+  static bool active() { return _depth > 0 && !_reporting; }
+
+  //! Total number of violations detected.
+  static std::uint64_t violations() {
+    return _violations.load(std::memory_order_relaxed);
+  }
+
+  /*!
+   * \brief Report a violation if the current thread is in a real-time scope.
+   * \param what Name of the offending operation, e.g. "malloc".
+   */
+  static void check(const char *what) {
+    if (!active()) {
+      return;
+    }
+    _reporting = true;
+    _violations.fetch_add(1, std::memory_order_relaxed);
+    write_message("Real-time violation: ");
+    write_message(what);
+    write_message("\n");
+    void *frames[32];
+    int depth = backtrace(frames, 32);
+    // Skip this function in the call stack.
+    backtrace_symbols_fd(frames + 1, depth - 1, STDERR_FILENO);
+    _reporting = false;
+  }
+
+private:
+  friend class RealtimeScope;
+
+  // Write to stderr without allocation or formatting.
+  static void write_message(const char *message) {
+    ssize_t result = ::write(STDERR_FILENO, message, std::strlen(message));
+    (void)result;
+  }
+
+  static inline thread_local unsigned _depth = 0;       // Scope nesting.
+  static inline thread_local bool _reporting = false;   // Report ongoing.
+  static inline std::atomic<std::uint64_t> _violations; // Total violations.
+};
+
+/*!
+ * \brief Mark a real-time code path for the scope of this object.
+ *
+ * Scopes can be nested, the thread stays real-time until the outermost scope
+ * ends.
+ */
+class RealtimeScope {
+public:
+  //! Enter real-time scope.
+  RealtimeScope() { RealtimeCheck::_depth += 1; }
+
+  //! Leave real-time scope.
+  ~RealtimeScope() { RealtimeCheck::_depth -= 1; }
+
+  RealtimeScope(const RealtimeScope &other) = delete;
+  RealtimeScope &operator=(const RealtimeScope &other) = delete;
+};
+
+} // namespace sosso
+
+#endif // SOSSO_REALTIMECHECK_HPP
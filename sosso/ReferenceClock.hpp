@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_REFERENCECLOCK_HPP
+#define SOSSO_REFERENCECLOCK_HPP
+
+#include "sosso/FrameClock.hpp"
+#include "sosso/Logging.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <new>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace sosso {
+
+/*!
+ * \brief External reference clock timeline.
+ *
+ * An external time base like word clock or house sync is published as a
+ * timeline, a reference frame position at a given CLOCK_MONOTONIC time plus
+ * the measured rate of the reference. The timeline is usually published by
+ * another process through POSIX shared memory, and read here without locks.
+ * For testing, a local timeline can be simulated with a given skew in ppm.
+ * The reference balance compares the reference to FrameClock, like the balance
+ * of a channel. Used as target for Correction, all channels are steered to the
+ * reference instead of the local clock.
+ */
+class ReferenceClock {
+public:
+  //! Always close before destruction.
+  ~ReferenceClock() { close(); }
+
+  //! Indicate that a timeline is attached.
+  bool is_open() const { return _timeline != nullptr; }
+
+  /*!
+   * \brief Attach to a timeline published in shared memory.
+   * \param name Name of the shared memory object, e.g. "/house_clock".
+   * \return True if successful, false means an error occurred.
+   */
+  bool open(const char *name) { return map(name, false); }
+
+  /*!
+   * \brief Create a timeline in shared memory, for publishing.
+   * \param name Name of the shared memory object, e.g. "/house_clock".
+   * \param sample_rate Nominal sample rate of the reference.
+   * \return True if successful, false means an error occurred.
+   */
+  bool create(const char *name, unsigned sample_rate) {
+    if (!map(name, true)) {
+      return false;
+    }
+    _timeline->sample_rate.store(sample_rate, std::memory_order_release);
+    return true;
+  }
+
+  /*!
+   * \brief Create a process local timeline, e.g. for simulation.
+   * \param sample_rate Nominal sample rate of the reference.
+   * \return True if successful, false means an error occurred.
+   */
+  bool create_local(unsigned sample_rate) {
+    close();
+    _local.reset(new Timeline());
+    _timeline = _local.get();
+    _timeline->sample_rate.store(sample_rate, std::memory_order_release);
+    _publisher = true;
+    return true;
+  }
+
+  //! Detach from the timeline, unlink shared memory if created here.
+  void close() {
+    if (_timeline && !_local) {
+      munmap(_timeline, sizeof(Timeline));
+      if (_publisher) {
+        shm_unlink(_name);
+      }
+    }
+    _timeline = nullptr;
+    _local.reset();
+    _publisher = false;
+    _simulation_start = -1;
+    reset_origin();
+  }
+
+  /*!
+   * \brief Publish a new timeline point, publisher side.
+   * \param monotonic_ns CLOCK_MONOTONIC time of the point, in nanoseconds.
+   * \param frames Reference frame position at that time.
+   * \param rate Measured reference rate, in frames per second.
+   * \return True if successful, false means no timeline created.
+   */
+  bool publish(std::int64_t monotonic_ns, std::int64_t frames, double rate) {
+    if (!_timeline || !_publisher) {
+      return false;
+    }
+    // Sequence lock, odd sequence while the point is written.
+    std::uint32_t sequence =
+        _timeline->sequence.load(std::memory_order_relaxed);
+    _timeline->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _timeline->monotonic_ns.store(monotonic_ns, std::memory_order_relaxed);
+    _timeline->frames.store(frames, std::memory_order_relaxed);
+    _timeline->rate.store(rate, std::memory_order_relaxed);
+    _timeline->sequence.store(sequence + 2, std::memory_order_release);
+    return true;
+  }
+
+  /*!
+   * \brief Publish a simulated reference, skewed against the local clock.
+   * \param skew_ppm Reference rate deviation from nominal, in ppm.
+   * \return True if successful, false means an error occurred.
+   */
+  bool simulate(double skew_ppm) {
+    std::int64_t now_ns = 0;
+    if (!_timeline || !monotonic_now(now_ns)) {
+      return false;
+    }
+    if (_simulation_start < 0) {
+      _simulation_start = now_ns;
+    }
+    double rate = sample_rate() * (1.0 + skew_ppm * 1e-6);
+    std::int64_t frames =
+        std::llround((now_ns - _simulation_start) * rate / 1e9);
+    return publish(now_ns, frames, rate);
+  }
+
+  //! Nominal sample rate of the reference, 0 if not published.
+  unsigned sample_rate() const {
+    if (!_timeline) {
+      return 0;
+    }
+    return _timeline->sample_rate.load(std::memory_order_acquire);
+  }
+
+  /*!
+   * \brief Reference position at a given time, extrapolated from timeline.
+   * \param time CLOCK_MONOTONIC time.
+   * \param frames Reference frame position, at nominal reference rate.
+   * \return True if successful, false means no timeline published yet.
+   */
+  bool position(const timespec &time, std::int64_t &frames) const {
+    std::int64_t monotonic_ns = 0;
+    std::int64_t anchor = 0;
+    double rate = 0;
+    if (!read(monotonic_ns, anchor, rate)) {
+      return false;
+    }
+    std::int64_t time_ns = time.tv_sec * 1000000000LL + time.tv_nsec;
+    frames = anchor + std::llround((time_ns - monotonic_ns) * rate / 1e9);
+    return true;
+  }
+
+  /*!
+   * \brief Balance of the reference against FrameClock.
+   *
+   * Like the balance of a channel, this is frame time minus the reference
+   * position, converted to the clock's sample rate. It is measured relative
+   * to the first balance after reset_origin(), so that it starts at zero
+   * like the channel balances. Use it as target for Correction.
+   * \param clock Frame clock of the channels.
+   * \param now Current frame time.
+   * \param balance Reference balance, in frames.
+   * \return True if successful, false means no timeline available.
+   */
+  bool balance(const FrameClock &clock, std::int64_t now,
+               std::int64_t &balance) {
+    std::int64_t frames = 0;
+    unsigned rate = sample_rate();
+    if (rate == 0 || !position(clock.frames_to_monotonic(now), frames)) {
+      return false;
+    }
+    // Convert to local sample rate, in case the reference differs.
+    if (rate != clock.sample_rate()) {
+      frames = frames * clock.sample_rate() / rate;
+    }
+    std::int64_t offset = now - frames;
+    if (!_has_origin) {
+      _origin = offset;
+      _has_origin = true;
+    }
+    balance = offset - _origin;
+    return true;
+  }
+
+  //! Measure the reference balance relative to the next balance call.
+  void reset_origin() {
+    _origin = 0;
+    _has_origin = false;
+  }
+
+private:
+  // Timeline layout in shared memory, lock free atomics only.
+  struct Timeline {
+    std::atomic<std::uint32_t> sequence = 0;    // Sequence lock counter.
+    std::atomic<std::uint32_t> sample_rate = 0; // Nominal reference rate.
+    std::atomic<std::int64_t> monotonic_ns = 0; // Time of timeline point.
+    std::atomic<std::int64_t> frames = 0;       // Reference position.
+    std::atomic<double> rate = 0;               // Measured reference rate.
+  };
+
+  // Read the latest timeline point consistently, retry while written.
+  bool read(std::int64_t &monotonic_ns, std::int64_t &frames,
+            double &rate) const {
+    if (!_timeline) {
+      return false;
+    }
+    for (unsigned retries = 0; retries < 64; ++retries) {
+      std::uint32_t before =
+          _timeline->sequence.load(std::memory_order_acquire);
+      monotonic_ns = _timeline->monotonic_ns.load(std::memory_order_relaxed);
+      frames = _timeline->frames.load(std::memory_order_relaxed);
+      rate = _timeline->rate.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      std::uint32_t after = _timeline->sequence.load(std::memory_order_relaxed);
+      if (before == after && (before & 1) == 0) {
+        // Sequence 0 means nothing published yet.
+        return before != 0;
+      }
+    }
+    return false;
+  }
+
+  // Map the shared memory timeline, create it if requested.
+  bool map(const char *name, bool publisher) {
+    close();
+    int flags = publisher ? (O_RDWR | O_CREAT) : O_RDONLY;
+    int fd = shm_open(name, flags, 0644);
+    if (fd < 0) {
+      Log::warn(SOSSO_LOC, "Unable to open reference %s, error %d.", name,
+                errno);
+      return false;
+    }
+    if (publisher && ftruncate(fd, sizeof(Timeline)) != 0) {
+      Log::warn(SOSSO_LOC, "Unable to size reference %s, error %d.", name,
+                errno);
+      ::close(fd);
+      shm_unlink(name);
+      return false;
+    }
+    int protection = publisher ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void *map = mmap(nullptr, sizeof(Timeline), protection, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      Log::warn(SOSSO_LOC, "Unable to map reference %s, error %d.", name,
+                errno);
+      return false;
+    }
+    _timeline = publisher ? new (map) Timeline() : static_cast<Timeline *>(map);
+    _publisher = publisher;
+    snprintf(_name, sizeof(_name), "%s", name);
+    return true;
+  }
+
+  // Current CLOCK_MONOTONIC time in nanoseconds.
+  static bool monotonic_now(std::int64_t &result) {
+    timespec now = {0, 0};
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+      Log::warn(SOSSO_LOC, "Get time failed with error %d.", errno);
+      return false;
+    }
+    result = now.tv_sec * 1000000000LL + now.tv_nsec;
+    return true;
+  }
+
+  Timeline *_timeline = nullptr;       // Attached timeline, shared or local.
+  std::unique_ptr<Timeline> _local;    // Process local timeline storage.
+  bool _publisher = false;             // Timeline was created here.
+  char _name[64] = {};                 // Shared memory name, for unlink.
+  std::int64_t _simulation_start = -1; // Start time of simulated reference.
+  std::int64_t _origin = 0;            // Initial reference balance offset.
+  bool _has_origin = false;            // Initial balance offset measured.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_REFERENCECLOCK_HPP
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2023 Florian Walpen <dev@submerge.ch>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOSSO_SEGMENTEDBUFFER_HPP
+#define SOSSO_SEGMENTEDBUFFER_HPP
+
+#include <algorithm>
+#include <cstring>
+
+namespace sosso {
+
+/*!
+ * \brief Scatter-Gather Buffer Management
+ *
+ * Like Buffer, but the externally allocated memory may consist of up to
+ * max_segments separate segments, e.g. the two parts of a ring buffer that
+ * wraps around. The segments are treated as one consecutive buffer, with a
+ * single read / write position across all segments. This lets ReadChannel and
+ * WriteChannel process non-contiguous memory directly, without copying it to
+ * a contiguous staging buffer first.
+ * Memory can only be accessed contiguously up to the end of the current
+ * segment, see contiguous(), so bulk transfers have to loop over segments.
+ * Like Buffer, the memory can only be passed on through move construction and
+ * move assignment.
+ */
+class SegmentedBuffer {
+public:
+  //! Maximum number of memory segments.
+  static constexpr unsigned max_segments = 4;
+
+  //! Construct an empty and invalid SegmentedBuffer.
+  SegmentedBuffer() = default;
+
+  /*!
+   * \brief Construct SegmentedBuffer with one initial memory segment.
+   * \param buffer Pointer to the externally allocated memory.
+   * \param length Length of the memory segment.
+   */
+  SegmentedBuffer(char *buffer, std::size_t length) {
+    add_segment(buffer, length);
+  }
+
+  /*!
+   * \brief Move construct a segmented buffer.
+   * \param other Adopt memory from this SegmentedBuffer, leaving it empty.
+   */
+  SegmentedBuffer(SegmentedBuffer &&other) noexcept { adopt(other); }
+
+  /*!
+   * \brief Move assign memory from another SegmentedBuffer.
+   * \param other Adopt memory from this SegmentedBuffer, leaving it empty.
+   * \return This newly assigned SegmentedBuffer.
+   */
+  SegmentedBuffer &operator=(SegmentedBuffer &&other) {
+    adopt(other);
+    return *this;
+  }
+
+  /*!
+   * \brief Append a memory segment at the end of the buffer.
+   * \param buffer Pointer to the externally allocated memory.
+   * \param length Length of the memory segment.
+   * \return True if successful, false if there are too many segments.
+   */
+  bool add_segment(char *buffer, std::size_t length) {
+    if (buffer == nullptr || length == 0 || _count >= max_segments) {
+      return false;
+    }
+    _segments[_count].data = buffer;
+    _segments[_count].length = length;
+    _count += 1;
+    _length += length;
+    return true;
+  }
+
+  //! Number of memory segments.
+  unsigned segments() const { return _count; }
+
+  //! Buffer is valid if there is accessible memory.
+  bool valid() const { return (_count > 0) && (_length > 0); }
+
+  //! Total length of all memory segments in bytes, 0 if invalid.
+  std::size_t length() const { return _length; }
+
+  //! Access the memory of the first segment, null if invalid.
+  char *data() const { return _segments[0].data; }
+
+  //! Access buffer memory at read / write position, null if invalid.
+  char *position() const {
+    if (!valid()) {
+      return nullptr;
+    }
+    std::size_t offset = 0;
+    const Segment &segment = locate(_position, offset);
+    return segment.data + offset;
+  }
+
+  //! Contiguous memory at read / write position until end of segment.
+  std::size_t contiguous() const {
+    if (done()) {
+      return 0;
+    }
+    std::size_t offset = 0;
+    return locate(_position, offset).length - offset;
+  }
+
+  //! Get read / write progress from buffer start, in bytes.
+  std::size_t progress() const { return _position; }
+
+  //! Remaining buffer memory in bytes, over all segments.
+  std::size_t remaining() const { return _length - _position; }
+
+  /*!
+   * \brief Cap given progress by remaining buffer memory.
+   * \param progress Progress in bytes.
+   * \return Progress limited by the remaining buffer memory.
+   */
+  std::size_t remaining(std::size_t progress) const {
+    if (progress > remaining()) {
+      progress = remaining();
+    }
+    return progress;
+  }
+
+  //! Indicate that the buffer is fully processed.
+  bool done() const { return _position == _length; }
+
+  //! Advance the buffer read / write position, across segments.
+  std::size_t advance(std::size_t progress) {
+    progress = remaining(progress);
+    _position += progress;
+    return progress;
+  }
+
+  //! Rewind the buffer read / write position, across segments.
+  std::size_t rewind(std::size_t progress) {
+    if (progress > _position) {
+      progress = _position;
+    }
+    _position -= progress;
+    return progress;
+  }
+
+  /*!
+   * \brief Erase an already processed part, rewind.
+   * \param begin Start position of the region to be erased.
+   * \param end End position of the region to be erased.
+   * \return The number of bytes that were effectively erased.
+   */
+  std::size_t erase(std::size_t begin, std::size_t end) {
+    if (begin < _position && begin < end) {
+      if (end > _position) {
+        end = _position;
+      }
+      // Move the data behind the region to its begin, segment by segment.
+      std::size_t to = begin;
+      std::size_t from = end;
+      while (from < _position) {
+        std::size_t to_offset = 0;
+        std::size_t from_offset = 0;
+        const Segment &to_segment = locate(to, to_offset);
+        const Segment &from_segment = locate(from, from_offset);
+        std::size_t chunk = std::min({_position - from,
+                                      to_segment.length - to_offset,
+                                      from_segment.length - from_offset});
+        std::memmove(to_segment.data + to_offset,
+                     from_segment.data + from_offset, chunk);
+        to += chunk;
+        from += chunk;
+      }
+      _position -= (end - begin);
+      return (end - begin);
+    }
+    return 0;
+  }
+
+  //! Reset the buffer position to zero.
+  void reset() { _position = 0; }
+
+  //! Clear the memory of all segments, position is unchanged.
+  void clear() { fill(0); }
+
+  //! Fill the memory of all segments with a byte value, e.g. silence.
+  void fill(char silence) {
+    for (unsigned i = 0; i < _count; ++i) {
+      std::memset(_segments[i].data, silence, _segments[i].length);
+    }
+  }
+
+  /*!
+   * \brief Clear buffer memory at read / write position, without advancing.
+   * \param length Length of the memory to be cleared, across segments.
+   * \param silence Byte value of silence, see Device::silence().
+   * \return The number of bytes that were effectively cleared.
+   */
+  std::size_t clear(std::size_t length, char silence = 0) {
+    length = remaining(length);
+    std::size_t cleared = 0;
+    while (cleared < length) {
+      std::size_t chunk = contiguous();
+      if (chunk > length - cleared) {
+        chunk = length - cleared;
+      }
+      std::memset(position(), silence, chunk);
+      _position += chunk;
+      cleared += chunk;
+    }
+    _position -= cleared;
+    return cleared;
+  }
+
+private:
+  // Memory segment, externally allocated.
+  struct Segment {
+    char *data = nullptr;   // Segment memory.
+    std::size_t length = 0; // Length of the segment memory.
+  };
+
+  // Find the segment of a buffer position, and the offset therein.
+  const Segment &locate(std::size_t position, std::size_t &offset) const {
+    offset = position;
+    unsigned i = 0;
+    while (i + 1 < _count && offset >= _segments[i].length) {
+      offset -= _segments[i].length;
+      ++i;
+    }
+    return _segments[i];
+  }
+
+  // Take over memory segments from another buffer, leaving it empty.
+  void adopt(SegmentedBuffer &other) {
+    for (unsigned i = 0; i < max_segments; ++i) {
+      _segments[i] = other._segments[i];
+      other._segments[i] = Segment();
+    }
+    _count = other._count;
+    _length = other._length;
+    _position = other._position;
+    other._count = 0;
+    other._length = 0;
+    other._position = 0;
+  }
+
+  Segment _segments[max_segments]; // External memory segments.
+  unsigned _count = 0;             // Number of memory segments in use.
+  std::size_t _length = 0;         // Total length of all segments.
+  std::size_t _position = 0;       // Current read / write position.
+};
+
+} // namespace sosso
+
+#endif // SOSSO_SEGMENTEDBUFFER_HPP
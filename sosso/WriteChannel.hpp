@@ -20,6 +20,7 @@
 #include "sosso/Buffer.hpp"
 #include "sosso/Channel.hpp"
 #include "sosso/Logging.hpp"
+#include <algorithm>
 #include <fcntl.h>
 
 namespace sosso {
@@ -31,6 +32,12 @@ namespace sosso {
  * of the OSS playback progress, and writes audio data from an external buffer
  * to the available OSS buffer. If the OSS buffer is memory mapped, the audio
  * data is copied there. Otherwise I/O write() system calls are used.
+ * The external buffer is either a Buffer or a SegmentedBuffer, any other type
+ * providing the same interface will do.
+ * Optionally the amount of audio data queued ahead of OSS progress can be
+ * limited, to keep output latency low despite a large OSS buffer.
+ * With a memory mapped OSS buffer, audio data that was already written but not
+ * played yet can be replaced later, see rewrite().
  */
 class WriteChannel : public Channel {
 public:
@@ -45,27 +52,53 @@ public:
     if (exclusive) {
       mode |= O_EXCL;
     }
+    // Sample counter mode and position are per device, start over.
+    _sample_counter = true;
+    _oss_progress = 0;
     return Channel::open(device, mode);
   }
 
-  //! Available OSS buffer space for writing, in frames.
+  //! Available OSS buffer space for writing within write-ahead limit, frames.
   std::int64_t oss_available() const {
-    std::int64_t result = last_progress() + buffer_frames() - _write_position;
+    std::int64_t result = last_progress() + write_ahead() - _write_position;
     if (result < 0) {
       result = 0;
-    } else if (result > buffer_frames()) {
-      result = buffer_frames();
+    } else if (result > write_ahead()) {
+      result = write_ahead();
     }
     return result;
   }
 
+  /*!
+   * \brief Limit the audio data queued ahead of OSS progress.
+   * \param frames Maximum frames queued ahead, 0 means whole OSS buffer.
+   */
+  void set_write_ahead(std::int64_t frames) { _write_ahead = frames; }
+
+  //! Effective maximum of frames queued ahead of OSS progress.
+  std::int64_t write_ahead() const {
+    if (_write_ahead > 0 && _write_ahead < buffer_frames()) {
+      return _write_ahead;
+    }
+    return buffer_frames();
+  }
+
   /*!
    * \brief Calculate next wakeup time.
    * \param sync_frames Required sync event (e.g. buffer end), in frame time.
    * \return Suggested and safe wakeup time for next process(), in frame time.
    */
   std::int64_t wakeup_time(std::int64_t sync_frames) const {
-    return Channel::wakeup_time(sync_frames, oss_available());
+    return Channel::wakeup_time(sync_frames, buffer_space());
+  }
+
+  /*!
+   * \brief Headroom until the OSS buffer is estimated to underrun.
+   * \param now Current time in frame time, see FrameClock.
+   * \return Slack in frames, negative if the dropout is overdue.
+   */
+  std::int64_t slack(std::int64_t now) const {
+    return estimated_dropout(buffer_space()) - now;
   }
 
   /*!
@@ -75,7 +108,8 @@ public:
    * \param now Current time in frame time, see FrameClock.
    * \return True if successful, false means there was an error.
    */
-  bool process(Buffer &buffer, std::int64_t end, std::int64_t now) {
+  template <class BufferType>
+  bool process(BufferType &buffer, std::int64_t end, std::int64_t now) {
     if (map()) {
       return (progress_done(now) || check_map_progress(now)) &&
              (buffer_done(buffer, end) || process_mapped(buffer, end, now));
@@ -85,6 +119,45 @@ public:
     }
   }
 
+  //! Earliest position of queued audio data that is safe to rewrite.
+  std::int64_t rewrite_position() const {
+    return last_progress() + progress_margin() + wakeup_margin() + stepping();
+  }
+
+  /*!
+   * \brief Replace queued audio data that was not played yet, mapped only.
+   *
+   * Overwrites the OSS buffer from rewrite_position() up to the current write
+   * position with updated audio data, where it overlaps the given buffer.
+   * To be called right after process(), when OSS progress is up to date.
+   * \param buffer Updated playback audio data, buffer position is restored.
+   * \param end Buffer end position, matching channel progress.
+   * \return The number of frames rewritten.
+   */
+  template <class BufferType>
+  std::int64_t rewrite(BufferType &buffer, std::int64_t end) {
+    if (!map() || !buffer.valid()) {
+      return 0;
+    }
+    std::int64_t begin = end - buffer.length() / frame_size();
+    std::int64_t from = std::max(begin, rewrite_position());
+    std::int64_t to = std::min(end, _write_position);
+    if (from >= to) {
+      return 0;
+    }
+    // Walk the buffer from the rewrite position, segment by segment.
+    std::size_t progress = buffer.progress();
+    buffer.reset();
+    buffer.advance((from - begin) * frame_size());
+    std::int64_t offset = from - last_progress();
+    unsigned pointer = (_oss_progress + offset) % buffer_frames();
+    std::size_t written = write_map_buffer(buffer, pointer * frame_size(),
+                                           (to - from) * frame_size());
+    buffer.reset();
+    buffer.advance(progress);
+    return written / frame_size();
+  }
+
 protected:
   // Indicate that OSS progress has already been checked.
   bool progress_done(std::int64_t now) { return (last_processing() == now); }
@@ -109,7 +182,7 @@ protected:
         _oss_progress = map_progress();
       }
       std::int64_t loss =
-          mark_loss(last_progress() + progress - _write_position);
+          account_loss(last_progress() + progress - _write_position, now);
       mark_progress(progress, now);
       if (loss > 0) {
         Log::warn(SOSSO_LOC, "OSS playback buffer underrun, %lld lost.", loss);
@@ -120,7 +193,8 @@ protected:
   }
 
   // Write playback audio data to a memory mapped OSS buffer.
-  bool process_mapped(Buffer &buffer, std::int64_t end, std::int64_t now) {
+  template <class BufferType>
+  bool process_mapped(BufferType &buffer, std::int64_t end, std::int64_t now) {
     // Buffer position should be between OSS progress and last write position.
     std::int64_t position = buffer_position(buffer.remaining(), end);
     if (std::int64_t skip =
@@ -139,9 +213,9 @@ protected:
         position -= rewind;
       }
     }
-    // The writable window is the whole buffer, starting from OSS progress.
+    // The writable window starts from OSS progress, within write-ahead limit.
     if (!buffer.done() && position >= last_progress() &&
-        position < last_progress() + buffer_frames()) {
+        position < last_progress() + write_ahead()) {
       if (_write_position < position && _write_position + 8 >= position) {
         // Small remaining gap between writes, fill in a replay patch.
         std::int64_t offset = _write_position - last_progress();
@@ -149,18 +223,17 @@ protected:
         std::size_t length = (position - _write_position) * frame_size();
         length = buffer.remaining(length);
         std::size_t written =
-            write_map(buffer.position(), pointer * frame_size(), length);
+            write_map_buffer(buffer, pointer * frame_size(), length);
+        buffer.rewind(written);
         Log::info(SOSSO_LOC, "@%lld - %lld Write small gap %lld, replay %lld.",
                   now, end, position - _write_position, written / frame_size());
       }
-      // Write from buffer offset up to either OSS or write buffer end.
+      // Write from buffer offset up to either write-ahead limit or buffer end.
       std::int64_t offset = position - last_progress();
       unsigned pointer = (_oss_progress + offset) % buffer_frames();
-      std::size_t length = (buffer_frames() - offset) * frame_size();
+      std::size_t length = (write_ahead() - offset) * frame_size();
       length = buffer.remaining(length);
-      std::size_t written =
-          write_map(buffer.position(), pointer * frame_size(), length);
-      buffer.advance(written);
+      write_map_buffer(buffer, pointer * frame_size(), length);
       _write_position = buffer_position(buffer.remaining(), end);
     }
     _write_position += freewheel_finish(buffer, end, now);
@@ -169,8 +242,12 @@ protected:
 
   // Check progress when using I/O write() system call.
   bool check_write_progress(std::int64_t now) {
+    if (_sample_counter && check_counter_progress(now)) {
+      return progress_done(now);
+    }
+    std::int64_t previous = last_progress();
     // Check for OSS buffer underruns.
-    std::int64_t overdue = now - estimated_dropout(oss_available());
+    std::int64_t overdue = now - estimated_dropout(buffer_space());
     if ((overdue > 0 && get_play_underruns() > 0) || overdue > max_progress()) {
       // OSS buffer underrun, estimate loss and progress from time.
       std::int64_t progress = _write_position - last_progress();
@@ -185,11 +262,40 @@ protected:
       mark_progress(progress, now);
       _write_position = last_progress() + queued;
     }
+    // Keep the counter position in sync, progress is not to be counted twice.
+    _oss_progress += last_progress() - previous;
     return progress_done(now);
   }
 
+  // Exact progress and loss from the absolute OSS sample counter, if provided.
+  bool check_counter_progress(std::int64_t now) {
+    std::int64_t samples = 0;
+    std::int64_t queued = 0;
+    if (!get_sample_count(samples, queued)) {
+      return false;
+    }
+    std::int64_t unplayed = _write_position - last_progress();
+    std::int64_t progress = samples - _oss_progress;
+    if (progress < unplayed - queued) {
+      // Counter lags behind the OSS queue, driver doesn't provide it.
+      Log::info(SOSSO_LOC, "OSS sample counter not usable, use queue.");
+      _sample_counter = false;
+      return false;
+    }
+    _oss_progress = samples;
+    // Frames played beyond what was written are lost to underruns.
+    std::int64_t loss = account_loss(progress - unplayed, now);
+    mark_progress(progress, now);
+    if (loss > 0) {
+      Log::warn(SOSSO_LOC, "OSS playback buffer underrun, %lld lost.", loss);
+    }
+    _write_position = last_progress() + queued;
+    return true;
+  }
+
   // Write playback audio data to OSS buffer using I/O write() system call.
-  bool process_write(Buffer &buffer, std::int64_t end, std::int64_t now) {
+  template <class BufferType>
+  bool process_write(BufferType &buffer, std::int64_t end, std::int64_t now) {
     bool ok = true;
     // Adjust buffer position to OSS write position, if possible.
     std::int64_t position = buffer_position(buffer.remaining(), end);
@@ -213,7 +319,9 @@ protected:
       std::int64_t gap = position - _write_position;
       std::size_t write_limit = buffer.remaining(gap * frame_size());
       std::size_t bytes_written = 0;
-      ok = write_io(buffer.position(), write_limit, bytes_written);
+      ok = write_io_buffer(buffer, write_limit, bytes_written);
+      // Replayed data is written again afterwards, keep buffer position.
+      buffer.rewind(bytes_written);
       Log::info(SOSSO_LOC, "@%lld - %lld Write buffer gap %lld, fill %lld.",
                 now, end, gap, bytes_written / frame_size());
       _write_position += bytes_written / frame_size();
@@ -221,9 +329,8 @@ protected:
       // Write as much as current progress allows.
       std::size_t length = buffer.remaining(oss_available() * frame_size());
       std::size_t bytes_written = 0;
-      ok = write_io(buffer.position(), length, bytes_written);
+      ok = write_io_buffer(buffer, length, bytes_written);
       _write_position += bytes_written / frame_size();
-      buffer.advance(bytes_written);
     }
     // Make sure buffers finish in time, despite irregular progress (freewheel).
     freewheel_finish(buffer, end, now);
@@ -231,18 +338,31 @@ protected:
   }
 
 private:
+  // Available OSS buffer space regardless of write-ahead limit, in frames.
+  std::int64_t buffer_space() const {
+    std::int64_t result = last_progress() + buffer_frames() - _write_position;
+    if (result < 0) {
+      result = 0;
+    } else if (result > buffer_frames()) {
+      result = buffer_frames();
+    }
+    return result;
+  }
+
   // Calculate write position of the remaining buffer.
   std::int64_t buffer_position(std::size_t remaining, std::int64_t end) const {
     return end - (remaining / frame_size());
   }
 
   // Indicate that a buffer doesn't need further processing.
-  bool buffer_done(const Buffer &buffer, std::int64_t end) const {
+  template <class BufferType>
+  bool buffer_done(const BufferType &buffer, std::int64_t end) const {
     return buffer.done() && end <= _write_position;
   }
 
   // Avoid stalled buffers with irregular OSS progress in freewheel mode.
-  std::int64_t freewheel_finish(Buffer &buffer, std::int64_t end,
+  template <class BufferType>
+  std::int64_t freewheel_finish(BufferType &buffer, std::int64_t end,
                                 std::int64_t now) {
     std::int64_t advance = 0;
     // Make sure buffers finish in time, despite irregular progress (freewheel).
@@ -256,7 +376,8 @@ private:
   }
 
   // Skip writing part of the buffer to match OSS write position.
-  std::int64_t buffer_advance(Buffer &buffer, std::int64_t frames) {
+  template <class BufferType>
+  std::int64_t buffer_advance(BufferType &buffer, std::int64_t frames) {
     if (frames > 0) {
       return buffer.advance(frames * frame_size()) / frame_size();
     }
@@ -264,15 +385,53 @@ private:
   }
 
   // Rewind part of the buffer to match OSS write postion.
-  std::int64_t buffer_rewind(Buffer &buffer, std::int64_t frames) {
+  template <class BufferType>
+  std::int64_t buffer_rewind(BufferType &buffer, std::int64_t frames) {
     if (frames > 0) {
       return buffer.rewind(frames * frame_size()) / frame_size();
     }
     return 0;
   }
 
-  std::int64_t _oss_progress = 0;   // Last memory mapped OSS progress.
+  // Write to memory mapped OSS buffer and advance, segment by segment.
+  template <class BufferType>
+  std::size_t write_map_buffer(BufferType &buffer, std::size_t offset,
+                               std::size_t length) {
+    std::size_t bytes_written = 0;
+    while (bytes_written < length && !buffer.done()) {
+      std::size_t chunk = std::min(length - bytes_written, buffer.contiguous());
+      chunk = write_map(buffer.position(), offset + bytes_written, chunk);
+      if (chunk == 0) {
+        break;
+      }
+      bytes_written += buffer.advance(chunk);
+    }
+    return bytes_written;
+  }
+
+  // Write through I/O write() syscall and advance, segment by segment.
+  template <class BufferType>
+  bool write_io_buffer(BufferType &buffer, std::size_t length,
+                       std::size_t &count) {
+    bool ok = true;
+    while (ok && length > 0 && !buffer.done()) {
+      std::size_t chunk = std::min(length, buffer.contiguous());
+      std::size_t bytes_written = 0;
+      ok = write_io(buffer.position(), chunk, bytes_written);
+      count += buffer.advance(bytes_written);
+      length -= bytes_written;
+      if (bytes_written < chunk) {
+        // OSS buffer is full for now.
+        break;
+      }
+    }
+    return ok;
+  }
+
+  std::int64_t _oss_progress = 0;   // Last memory mapped or counted progress.
   std::int64_t _write_position = 0; // Current write position of the channel.
+  std::int64_t _write_ahead = 0;    // Limit of frames queued, 0 if none.
+  bool _sample_counter = true;      // Use absolute OSS sample counter.
 };
 
 } // namespace sosso